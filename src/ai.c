@@ -4,24 +4,88 @@
 #include <ggml-backend.h>
 #include <ggml.h>
 #include <llama.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
 
 #define GPU_LAYERS 99
-static const char STOP_CHARS[] = {'[', '*', '('};
 
-static int containsStopChar(char string[]) {
-  for (size_t i = 0; i < arrLen(STOP_CHARS); i++) {
-    if (strchr(string, STOP_CHARS[i]) != NULL) {
-      return 1;
+// Loaded models are read-only and expensive in both memory and load time.
+// Instances pointing to the same file share them through this registry.
+typedef struct {
+  const char *path;
+  struct llama_model *model;
+  size_t references;
+} model_entry_t;
+
+static model_entry_t models[4] = {};
+
+static struct llama_model *modelAcquire(const char *path) {
+  model_entry_t *free_entry = NULL;
+  for (size_t i = 0; i < arrLen(models); i++) {
+    model_entry_t *entry = &models[i];
+    if (entry->model && strcmp(entry->path, path) == 0) {
+      entry->references++;
+      return entry->model;
+    }
+
+    if (!entry->model && !free_entry) {
+      free_entry = entry;
+    }
+  }
+
+  if (!free_entry) {
+    return NULL;
+  }
+
+  ggml_backend_load_all();
+  struct llama_model_params params = llama_model_default_params();
+  params.n_gpu_layers = GPU_LAYERS;
+
+  free_entry->model = llama_model_load_from_file(path, params);
+  if (!free_entry->model) {
+    return NULL;
+  }
+
+  free_entry->path = path;
+  free_entry->references = 1;
+  return free_entry->model;
+}
+
+static void modelRelease(struct llama_model **model) {
+  if (!model || !*model)
+    return;
+
+  int is_last = 1;
+  for (size_t i = 0; i < arrLen(models); i++) {
+    model_entry_t *entry = &models[i];
+    if (entry->model == *model && --entry->references == 0) {
+      llama_model_free(entry->model);
+      entry->model = NULL;
+      entry->path = NULL;
+    }
+
+    if (entry->model) {
+      is_last = 0;
     }
   }
-  return 0;
+
+  if (is_last) {
+    llama_backend_free();
+  }
+  *model = NULL;
+}
+
+static tokens_t *tokensCreate(size_t cap) {
+  tokens_t *tokens = NULL;
+  bufCreate(tokens_t, llama_token, tokens, cap);
+  return tokens;
 }
 
+static void tokensDestroy(tokens_t **self) { deallocate(self); }
+
 static void filterLogs(enum ggml_log_level level, const char *text,
                          void *data) {
   (void)level;
@@ -29,42 +93,165 @@ static void filterLogs(enum ggml_log_level level, const char *text,
   (void)data;
 }
 
-static ai_result_t initSampler(ai_t *ai, config_t *configuration) {
-  if (ai->sampler) {
-    llama_sampler_free(ai->sampler);
+static struct llama_sampler *createSampler(ai_t *ai,
+                                           const config_t *configuration,
+                                           const string_t *grammar,
+                                           uint32_t seed) {
+  struct llama_sampler *sampler =
+      llama_sampler_chain_init(llama_sampler_chain_default_params());
+  if (!sampler) {
+    return NULL;
   }
 
-  ai->sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-  if (!ai->sampler) {
-    return AI_RESULT_ERROR;
-  }
-
-  if (configuration->grammar) {
-    struct llama_sampler *grammar_sampler = llama_sampler_init_grammar(
-        ai->vocabulary, configuration->grammar->data, "root");
+  if (grammar) {
+    struct llama_sampler *grammar_sampler =
+        llama_sampler_init_grammar(ai->vocabulary, grammar->data, "root");
 
     if (!grammar_sampler) {
-      return AI_RESULT_ERROR;
+      llama_sampler_free(sampler);
+      return NULL;
     }
-    llama_sampler_chain_add(ai->sampler, grammar_sampler);
+    llama_sampler_chain_add(sampler, grammar_sampler);
   }
 
-  llama_sampler_chain_add(ai->sampler,
+  llama_sampler_chain_add(sampler,
                           llama_sampler_init_penalties(
                               -1, configuration->repetition_penalty, 0, 0));
-  llama_sampler_chain_add(ai->sampler,
+  llama_sampler_chain_add(sampler,
                           llama_sampler_init_temp(configuration->temp));
-  llama_sampler_chain_add(ai->sampler,
+  llama_sampler_chain_add(sampler,
                           llama_sampler_init_top_k(configuration->top_k));
-  llama_sampler_chain_add(ai->sampler,
+  llama_sampler_chain_add(sampler,
                           llama_sampler_init_min_p(configuration->min_p, 1));
+  llama_sampler_chain_add(sampler, llama_sampler_init_dist(seed));
+  return sampler;
+}
+
+static samplers_t *samplersCreate(size_t cap) {
+  samplers_t *samplers = NULL;
+  bufCreate(samplers_t, struct llama_sampler *, samplers, cap);
+  return samplers;
+}
+
+static void samplersDestroy(samplers_t **self) {
+  if (!self || !*self)
+    return;
+
+  size_t i = 0;
+  bufEach(*self, i) { llama_sampler_free(bufAt(*self, i)); }
+  deallocate(self);
+}
+
+static samplers_t *samplersInit(ai_t *ai, const config_t *configuration,
+                                const string_t *grammar, size_t count) {
+  samplers_t *samplers = samplersCreate(count);
+  if (!samplers) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    // A random seed is picked on every reset only with the default seed. Using
+    // it ensures retries and candidates from the same prompt differ.
+    uint32_t seed = configuration->seed == 0
+                        ? LLAMA_DEFAULT_SEED
+                        : configuration->seed + (uint32_t)i;
+    struct llama_sampler *sampler =
+        createSampler(ai, configuration, grammar, seed);
+    if (!sampler) {
+      samplersDestroy(&samplers);
+      return NULL;
+    }
+    bufPush(samplers, sampler);
+  }
+  return samplers;
+}
+
+static void grammarEntryClear(grammar_entry_t *entry) {
+  samplersDestroy(&entry->samplers);
+  strDestroy(&entry->grammar);
+  entry->used = 0;
+}
+
+static bool grammarEntryMatches(const grammar_entry_t *entry,
+                                const string_t *grammar) {
+  if (!entry->grammar || !grammar) {
+    return !entry->grammar && !grammar;
+  }
+  return strEq(entry->grammar, grammar);
+}
+
+// Makes the samplers for the given grammar the current ones. Grammars are
+// parsed and sampler chains are built only the first time they are seen; after
+// that, they are just reset. The least recently used chains are evicted.
+static ai_result_t useGrammar(ai_t *ai, const string_t *grammar) {
+  grammar_entry_t *entry = NULL;
+  for (size_t i = 0; i < arrLen(ai->grammars); i++) {
+    grammar_entry_t *current = &ai->grammars[i];
+    if (current->samplers && grammarEntryMatches(current, grammar)) {
+      entry = current;
+      break;
+    }
+
+    if (!entry || current->used < entry->used) {
+      entry = current;
+    }
+  }
+
+  if (!entry->samplers || !grammarEntryMatches(entry, grammar)) {
+    if (entry->samplers == ai->samplers) {
+      ai->samplers = NULL;
+    }
+    grammarEntryClear(entry);
+
+    if (grammar) {
+      entry->grammar = strDup(grammar);
+      if (!entry->grammar) {
+        return AI_RESULT_ERROR_ALLOCATION_FAILED;
+      }
+    }
+
+    const uint32_t candidates = ai->configuration->candidates;
+    entry->samplers = samplersInit(ai, ai->configuration, entry->grammar,
+                                   candidates ? candidates : 1);
+    if (!entry->samplers) {
+      grammarEntryClear(entry);
+      return AI_RESULT_ERROR;
+    }
+  } else {
+    size_t i = 0;
+    bufEach(entry->samplers, i) {
+      llama_sampler_reset(bufAt(entry->samplers, i));
+    }
+  }
 
-  uint32_t seed =
-      configuration->seed == 0 ? (uint32_t)time(NULL) : configuration->seed;
-  llama_sampler_chain_add(ai->sampler, llama_sampler_init_dist(seed));
+  ai->samplers = entry->samplers;
+  entry->used = ++ai->grammar_clock;
   return AI_RESULT_OK;
 }
 
+// Tokenizes a template, special tokens included. It has no BOS since it can be
+// found anywhere in a prompt.
+static tokens_t *templateTokenize(const ai_t *ai, const char *text,
+                                  size_t len) {
+  // Each token takes at least one character
+  tokens_t *tokens = tokensCreate(len);
+  if (!tokens) {
+    return NULL;
+  }
+
+  if (len > 0) {
+    const int32_t count =
+        llama_tokenize(ai->vocabulary, text, (int32_t)len, tokens->data,
+                       (int32_t)tokens->cap, false, true);
+    if (count < 0) {
+      tokensDestroy(&tokens);
+      return NULL;
+    }
+    tokens->len = (size_t)count;
+  }
+  return tokens;
+}
+
 ai_t *aiCreate(config_t *configuration, ai_result_t *result) {
 #define throw(Error)                                                           \
   *result = Error;                                                             \
@@ -77,30 +264,85 @@ ai_t *aiCreate(config_t *configuration, ai_result_t *result) {
     throw(AI_RESULT_ERROR_ALLOCATION_FAILED);
   }
 
-  ggml_backend_load_all();
-  struct llama_model_params params = llama_model_default_params();
-  params.n_gpu_layers = GPU_LAYERS;
-
-  ai->model = llama_model_load_from_file(configuration->path, params);
+  ai->model = modelAcquire(configuration->path);
   if (!ai->model) {
     throw(AI_RESULT_ERROR_LOAD_MODEL_FAILED);
   }
 
   ai->vocabulary = llama_model_get_vocab(ai->model);
 
+  uint32_t sequences =
+      configuration->candidates ? configuration->candidates : 1;
+  if (configuration->ranked > sequences) {
+    sequences = configuration->ranked;
+  }
+
+  // Each candidate or ranked label is a sequence with the full context size at
+  // its disposal
   struct llama_context_params ctx_params = llama_context_default_params();
-  ctx_params.n_ctx = configuration->context_size;
+  ctx_params.n_ctx = configuration->context_size * sequences;
+  ctx_params.n_seq_max = sequences;
   ai->context = llama_init_from_model(ai->model, ctx_params);
   if (!ai->context) {
     throw(AI_RESULT_ERROR_CREATE_CONTEXT_FAILED);
   }
 
-  *result = initSampler(ai, configuration);
+  ai->configuration = configuration;
+  *result = useGrammar(ai, configuration->grammar);
   if (*result != AI_RESULT_OK) {
     throw(*result);
   }
 
-  ai->configuration = configuration;
+  ai->cache = tokensCreate(configuration->context_size);
+  if (!ai->cache) {
+    throw(AI_RESULT_ERROR_ALLOCATION_FAILED);
+  }
+
+  // Templates wrap every message: their parts are only tokenized once
+  for (size_t i = 0; i < PROMPT_TYPES; i++) {
+    const string_t *template = configuration->prompt_templates[i];
+    const char *placeholder = strstr(template->data, "%s");
+    const size_t head_len =
+        placeholder ? (size_t)(placeholder - template->data) : template->len;
+    const char *tail = placeholder ? placeholder + 2 : "";
+
+    ai->template_heads[i] = templateTokenize(ai, template->data, head_len);
+    ai->template_tails[i] = templateTokenize(ai, tail, strlen(tail));
+    if (!ai->template_heads[i] || !ai->template_tails[i]) {
+      throw(AI_RESULT_ERROR_TOKENIZATION_FAILED);
+    }
+  }
+
+  if (configuration->draft_path) {
+    ai->draft_model = modelAcquire(configuration->draft_path);
+    if (!ai->draft_model) {
+      throw(AI_RESULT_ERROR_LOAD_MODEL_FAILED);
+    }
+
+    // Drafts are compared with the main model's tokens one by one
+    const struct llama_vocab *draft_vocabulary =
+        llama_model_get_vocab(ai->draft_model);
+    if (llama_vocab_n_tokens(draft_vocabulary) !=
+        llama_vocab_n_tokens(ai->vocabulary)) {
+      throw(AI_RESULT_ERROR_LOAD_MODEL_FAILED);
+    }
+
+    ai->draft_context = llama_init_from_model(ai->draft_model, ctx_params);
+    if (!ai->draft_context) {
+      throw(AI_RESULT_ERROR_CREATE_CONTEXT_FAILED);
+    }
+
+    ai->draft_sampler = llama_sampler_init_greedy();
+    if (!ai->draft_sampler) {
+      throw(AI_RESULT_ERROR);
+    }
+
+    ai->draft_cache = tokensCreate(configuration->context_size);
+    if (!ai->draft_cache) {
+      throw(AI_RESULT_ERROR_ALLOCATION_FAILED);
+    }
+  }
+
   *result = AI_RESULT_OK;
   return ai;
 
@@ -110,84 +352,1185 @@ error:
 #undef throw
 }
 
-ai_result_t aiGenerate(ai_t *ai, const string_t *prompt, string_t *response) {
-  const bool is_first =
-      llama_memory_seq_pos_max(llama_get_memory(ai->context), 0) == -1;
+// Drops from the KV cache whatever follows the longest prefix it shares with
+// the given tokens. Returns the length of such prefix.
+static size_t reuseCachedPrefix(struct llama_context *context, tokens_t *cache,
+                                const llama_token *tokens, size_t len) {
+  size_t prefix = 0;
+  while (prefix < cache->len && prefix < len &&
+         bufAt(cache, prefix) == tokens[prefix]) {
+    prefix++;
+  }
 
-  const int tok_count = -llama_tokenize(
-      ai->vocabulary, prompt->data, (int)prompt->len, NULL, 0, is_first, true);
+  // At least one token must be decoded to get logits to sample from
+  if (prefix == len && prefix > 0) {
+    prefix--;
+  }
 
-  llama_token *tokens = allocate(sizeof(llama_token) * (size_t)tok_count);
-  if (!tokens) {
-    deallocate(&tokens);
-    return AI_RESULT_ERROR_ALLOCATION_FAILED;
+  llama_memory_t memory = llama_get_memory(context);
+  if (!llama_memory_seq_rm(memory, 0, (llama_pos)prefix, -1)) {
+    llama_memory_clear(memory, true);
+    prefix = 0;
   }
 
-  if (llama_tokenize(ai->vocabulary, prompt->data, (int)prompt->len, tokens,
-                     tok_count, is_first, true) < 0) {
-    deallocate(&tokens);
+  cache->len = prefix;
+  return prefix;
+}
+
+static void cacheAppend(tokens_t *cache, const llama_batch *batch) {
+  for (int32_t i = 0; i < batch->n_tokens; i++) {
+    bufPush(cache, batch->token[i]);
+  }
+}
+
+// Appends the text of the token to the response
+static ai_result_t appendToken(ai_t *ai, llama_token token,
+                               string_t *response) {
+  char parsed_token[256] = {};
+  int32_t offset = llama_token_to_piece(
+      ai->vocabulary, token, parsed_token, sizeof(parsed_token), 0, false);
+
+  if (offset < 0) {
+    return AI_RESULT_ERROR_TOKEN_PARSING_FAILED;
+  }
+
+  if (response->len + (size_t)offset > response->cap) {
+    return AI_RESULT_ERROR_RESPONSE_LENGTH_EXCEEDED;
+  }
+
+  strFmtAppend(response, "%s", parsed_token);
+  return AI_RESULT_OK;
+}
+
+static ai_result_t decodePrompt(struct llama_context *context, tokens_t *cache,
+                                llama_token *tokens, size_t len) {
+  size_t cached = reuseCachedPrefix(context, cache, tokens, len);
+  llama_batch batch =
+      llama_batch_get_one(tokens + cached, (int32_t)(len - cached));
+
+  if (llama_decode(context, batch) != 0) {
+    // The state of the KV cache is unknown after a failure
+    llama_memory_clear(llama_get_memory(context), true);
+    cache->len = 0;
+    return AI_RESULT_ERROR_BATCH_DECODING_FAILED;
+  }
+  cacheAppend(cache, &batch);
+  return AI_RESULT_OK;
+}
+
+// Decodes the prompt on the first sequence, for the draft model as well. Only
+// the part following the prefix already in the KV cache is evaluated.
+static ai_result_t prefill(ai_t *ai, tokens_t *prompt) {
+  if (prompt->len == 0) {
     return AI_RESULT_ERROR_TOKENIZATION_FAILED;
   }
 
-  llama_batch batch = llama_batch_get_one(tokens, tok_count);
+  if (prompt->len > ai->configuration->context_size) {
+    return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+  }
+
+  ai_result_t result =
+      decodePrompt(ai->context, ai->cache, prompt->data, prompt->len);
+  if (result == AI_RESULT_OK && ai->draft_context) {
+    result = decodePrompt(ai->draft_context, ai->draft_cache, prompt->data,
+                          prompt->len);
+  }
+  return result;
+}
+
+// Prompts start with BOS, if the model expects it
+static ai_result_t promptStart(const ai_t *ai, tokens_t *prompt) {
+  if (prompt->len > 0 || !llama_vocab_get_add_bos(ai->vocabulary)) {
+    return AI_RESULT_OK;
+  }
+
+  if (prompt->cap == 0) {
+    return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+  }
+  bufPush(prompt, llama_vocab_bos(ai->vocabulary));
+  return AI_RESULT_OK;
+}
+
+// Tokenizes the text straight into the spare capacity of the buffer
+static ai_result_t tokenize(const ai_t *ai, tokens_t *tokens, const char *text,
+                            size_t len, bool special) {
+  ai_result_t result = promptStart(ai, tokens);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  const int32_t count = llama_tokenize(
+      ai->vocabulary, text, (int32_t)len, tokens->data + tokens->len,
+      (int32_t)(tokens->cap - tokens->len), false, special);
+
+  // A negative count is the number of tokens that did not fit
+  if (count < 0) {
+    return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+  }
+  tokens->len += (size_t)count;
+  return AI_RESULT_OK;
+}
+
+tokens_t *aiPromptCreate(const ai_t *self) {
+  return tokensCreate(self->configuration->context_size);
+}
+
+void aiPromptDestroy(tokens_t **self) { tokensDestroy(self); }
+
+ai_result_t aiPromptAppendText(const ai_t *self, tokens_t *prompt,
+                               const char *text) {
+  return tokenize(self, prompt, text, strlen(text), false);
+}
+
+ai_result_t aiPromptAppendOpen(const ai_t *self, tokens_t *prompt,
+                               prompt_type_t type, const char *text) {
+  ai_result_t result = promptStart(self, prompt);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  result = aiPromptAppendTokens(prompt, self->template_heads[type]);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+  return aiPromptAppendText(self, prompt, text);
+}
+
+ai_result_t aiPromptAppend(const ai_t *self, tokens_t *prompt,
+                           prompt_type_t type, const char *text) {
+  ai_result_t result = aiPromptAppendOpen(self, prompt, type, text);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+  return aiPromptAppendTokens(prompt, self->template_tails[type]);
+}
+
+ai_result_t aiPromptAppendTokens(tokens_t *prompt, const tokens_t *tokens) {
+  if (prompt->len + tokens->len > prompt->cap) {
+    return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+  }
+
+  memcpy(prompt->data + prompt->len, tokens->data,
+         sizeof(llama_token) * tokens->len);
+  prompt->len += tokens->len;
+  return AI_RESULT_OK;
+}
+
+// Responses end where the next message starts
+static llama_token endToken(const ai_t *ai) {
+  const tokens_t *next = ai->template_heads[PROMPT_TYPE_USR];
+  return next->len > 0 && llama_vocab_is_eog(ai->vocabulary, bufAt(next, 0))
+             ? bufAt(next, 0)
+             : llama_vocab_eos(ai->vocabulary);
+}
+
+// Decodes the tokens appended without sampling since the last decode
+static ai_result_t decodePending(ai_t *ai, llama_token *pending, size_t *len) {
+  if (*len == 0) {
+    return AI_RESULT_OK;
+  }
+
+  if (ai->cache->len + *len > ai->configuration->context_size) {
+    return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+  }
+
+  llama_batch batch = llama_batch_get_one(pending, (int32_t)*len);
+  if (llama_decode(ai->context, batch) != 0) {
+    aiClear(ai);
+    return AI_RESULT_ERROR_BATCH_DECODING_FAILED;
+  }
+  cacheAppend(ai->cache, &batch);
+  *len = 0;
+  return AI_RESULT_OK;
+}
+
+// Walks the trie of choices from the root. Where a node has a single way
+// forward, its token is taken as it is: the model is only run where there is
+// an actual choice, and then only on the tokens allowed there.
+static ai_result_t generateChoice(ai_t *ai, tokens_t *prompt,
+                                  string_t *response) {
+  ai_result_t result = prefill(ai, prompt);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  struct llama_sampler *sampler = bufAt(ai->samplers, 0);
+  const llama_token end = endToken(ai);
+  llama_token pending[AI_CHOICE_TOKENS];
+  size_t pending_len = 0;
+  llama_token_data candidates[AI_CHOICE_BRANCHES + 1];
+
+  uint32_t node = 0;
+  while (bufAt(ai->choices, node).child != 0) {
+    const trie_node_t *current = &ai->choices->data[node];
+    uint32_t next = current->child;
+
+    if (current->terminal || bufAt(ai->choices, next).sibling != 0) {
+      result = decodePending(ai, pending, &pending_len);
+      if (result != AI_RESULT_OK) {
+        return result;
+      }
+
+      const float *logits = llama_get_logits_ith(ai->context, -1);
+      size_t count = 0;
+      for (uint32_t child = next; child != 0;
+           child = bufAt(ai->choices, child).sibling) {
+        const llama_token token = bufAt(ai->choices, child).token;
+        candidates[count++] = (llama_token_data){token, logits[token], 0};
+      }
+      if (current->terminal) {
+        candidates[count++] = (llama_token_data){end, logits[end], 0};
+      }
+
+      llama_token_data_array choices = {candidates, count, -1, false};
+      llama_sampler_apply(sampler, &choices);
+      if (choices.selected < 0 || (size_t)choices.selected >= count) {
+        return AI_RESULT_ERROR_INVALID_OUTPUT_DETECTED;
+      }
+
+      const llama_token token = candidates[choices.selected].id;
+      if (current->terminal && token == end) {
+        break;
+      }
+      while (bufAt(ai->choices, next).token != token) {
+        next = bufAt(ai->choices, next).sibling;
+      }
+    }
+
+    const llama_token token = bufAt(ai->choices, next).token;
+    llama_sampler_accept(sampler, token);
+    result = appendToken(ai, token, response);
+    if (result != AI_RESULT_OK) {
+      return result;
+    }
+    pending[pending_len++] = token;
+    node = next;
+  }
+
+  // Tokens forced after the last choice are never decoded: nothing follows them
+  return AI_RESULT_OK;
+}
+
+ai_result_t aiPrefill(ai_t *self, tokens_t *prompt) {
+  return prefill(self, prompt);
+}
+
+ai_result_t aiGenerate(ai_t *ai, tokens_t *prompt, string_t *response) {
+  if (ai->choices && !bufIsEmpty(ai->choices)) {
+    return generateChoice(ai, prompt, response);
+  }
+
+  ai_result_t result = prefill(ai, prompt);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  struct llama_sampler *sampler = bufAt(ai->samplers, 0);
   llama_token token_id;
 
   while (true) {
-    uint32_t context_size = llama_n_ctx(ai->context);
-    llama_memory_t memory = llama_get_memory(ai->context);
-    llama_pos current_context_length = llama_memory_seq_pos_max(memory, 0) + 1;
+    token_id = llama_sampler_sample(sampler, ai->context, -1);
+
+    if (llama_vocab_is_eog(ai->vocabulary, token_id)) {
+      break;
+    }
+
+    result = appendToken(ai, token_id, response);
+    if (result != AI_RESULT_OK) {
+      return result;
+    }
 
-    if (current_context_length + batch.n_tokens > (int)context_size) {
-      deallocate(&tokens);
+    if (ai->cache->len + 1 > ai->configuration->context_size) {
       return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
     }
 
+    llama_batch batch = llama_batch_get_one(&token_id, 1);
     if (llama_decode(ai->context, batch) != 0) {
-      deallocate(&tokens);
+      aiClear(ai);
       return AI_RESULT_ERROR_BATCH_DECODING_FAILED;
     };
+    cacheAppend(ai->cache, &batch);
+  }
 
-    token_id = llama_sampler_sample(ai->sampler, ai->context, -1);
+  return AI_RESULT_OK;
+}
 
-    if (llama_vocab_is_eog(ai->vocabulary, token_id)) {
+typedef struct {
+  llama_token tokens[AI_LABEL_TOKENS];
+  size_t len;
+  // Whether the label is the beginning of another one. Then the end of the
+  // response must be scored too, to tell them apart.
+  bool prefix;
+  // Whether the label was cut to its first AI_LABEL_TOKENS tokens. Then what
+  // follows its last token is unknown, and is not scored.
+  bool truncated;
+  double score;
+} label_t;
+
+// Tokenizes the label, keeping the first AI_LABEL_TOKENS tokens of longer ones
+static ai_result_t tokenizeLabel(const ai_t *ai, const char *text, size_t len,
+                                 label_t *label) {
+  int32_t count = llama_tokenize(ai->vocabulary, text, (int32_t)len,
+                                 label->tokens, AI_LABEL_TOKENS, false, false);
+  if (count < 0) {
+    // The number of tokens needed, negated
+    llama_token *tokens = allocate(sizeof(llama_token) * (size_t)-count);
+    if (!tokens) {
+      return AI_RESULT_ERROR_ALLOCATION_FAILED;
+    }
+    count = llama_tokenize(ai->vocabulary, text, (int32_t)len, tokens, -count,
+                           false, false);
+    if (count > 0) {
+      memcpy(label->tokens, tokens, sizeof(label->tokens));
+      label->truncated = true;
+      count = AI_LABEL_TOKENS;
+    }
+    deallocate(&tokens);
+  }
+
+  if (count <= 0) {
+    return AI_RESULT_ERROR_TOKENIZATION_FAILED;
+  }
+  label->len = (size_t)count;
+  return AI_RESULT_OK;
+}
+
+// Log of the sum of the exponentials of the logits. Subtracted from a logit,
+// it gives the log-probability of its token.
+static double logNormalizer(const float *logits, int32_t vocabulary_size) {
+  float max = logits[0];
+  for (int32_t i = 1; i < vocabulary_size; i++) {
+    if (logits[i] > max)
+      max = logits[i];
+  }
+
+  double sum = 0;
+  for (int32_t i = 0; i < vocabulary_size; i++) {
+    sum += exp((double)(logits[i] - max));
+  }
+  return (double)max + log(sum);
+}
+
+// Scores the next token of the labels in the group, which share their first
+// depth tokens. Then decodes each distinct next token that is followed by
+// more tokens to score, and scores the resulting groups in turn.
+static ai_result_t scoreLabels(ai_t *ai, label_t *labels, const size_t *group,
+                               size_t count, size_t depth, llama_token end) {
+  const float *logits = llama_get_logits_ith(ai->context, -1);
+  const double normalizer =
+      logNormalizer(logits, llama_vocab_n_tokens(ai->vocabulary));
+  for (size_t i = 0; i < count; i++) {
+    label_t *label = &labels[group[i]];
+    if (depth < label->len) {
+      label->score += (double)logits[label->tokens[depth]] - normalizer;
+    } else if (label->prefix) {
+      label->score += (double)logits[end] - normalizer;
+    }
+  }
+
+  const size_t position = ai->cache->len;
+  bool visited[AI_LABELS] = {};
+  for (size_t i = 0; i < count; i++) {
+    const label_t *label = &labels[group[i]];
+    const bool scores_more =
+        depth + 1 < label->len || (depth + 1 == label->len && label->prefix);
+    if (visited[i] || !scores_more)
+      continue;
+
+    // Labels continuing with the same token are scored together
+    llama_token token = label->tokens[depth];
+    size_t subgroup[AI_LABELS];
+    size_t subcount = 0;
+    for (size_t j = i; j < count; j++) {
+      const label_t *other = &labels[group[j]];
+      if (!visited[j] && depth < other->len && other->tokens[depth] == token) {
+        visited[j] = true;
+        subgroup[subcount++] = group[j];
+      }
+    }
+
+    if (position + 1 > ai->configuration->context_size) {
+      return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+    }
+
+    // Siblings decoded before are dropped, as they are not part of the prefix
+    llama_memory_seq_rm(llama_get_memory(ai->context), 0, (llama_pos)position,
+                        -1);
+    ai->cache->len = position;
+    llama_batch batch = llama_batch_get_one(&token, 1);
+    if (llama_decode(ai->context, batch) != 0) {
+      aiClear(ai);
+      return AI_RESULT_ERROR_BATCH_DECODING_FAILED;
+    }
+    cacheAppend(ai->cache, &batch);
+
+    ai_result_t result =
+        scoreLabels(ai, labels, subgroup, subcount, depth + 1, end);
+    if (result != AI_RESULT_OK) {
+      return result;
+    }
+  }
+  return AI_RESULT_OK;
+}
+
+ai_result_t aiClassify(ai_t *ai, tokens_t *prompt, string_t *const *labels,
+                       size_t count, size_t *best, float *margin) {
+  if (count == 0 || count > AI_LABELS) {
+    return AI_RESULT_ERROR;
+  }
+
+  label_t candidates[AI_LABELS] = {};
+  size_t group[AI_LABELS];
+  for (size_t i = 0; i < count; i++) {
+    const ai_result_t result =
+        tokenizeLabel(ai, labels[i]->data, labels[i]->len, &candidates[i]);
+    if (result != AI_RESULT_OK) {
+      return result;
+    }
+    group[i] = i;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < count && !candidates[i].prefix; j++) {
+      candidates[i].prefix =
+          i != j && candidates[i].len < candidates[j].len &&
+          memcmp(candidates[i].tokens, candidates[j].tokens,
+                 sizeof(llama_token) * candidates[i].len) == 0;
+    }
+  }
+
+  ai_result_t result = prefill(ai, prompt);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  result = scoreLabels(ai, candidates, group, count, 0, endToken(ai));
+
+  // Labels are not part of the prompt: leave the cache as the prompt left it
+  llama_memory_seq_rm(llama_get_memory(ai->context), 0,
+                      (llama_pos)prompt->len, -1);
+  if (ai->cache->len > prompt->len) {
+    ai->cache->len = prompt->len;
+  }
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  *best = 0;
+  for (size_t i = 1; i < count; i++) {
+    if (candidates[i].score > candidates[*best].score)
+      *best = i;
+  }
+
+  double runner_up = -INFINITY;
+  for (size_t i = 0; i < count; i++) {
+    if (i != *best && candidates[i].score > runner_up)
+      runner_up = candidates[i].score;
+  }
+  *margin = (float)(candidates[*best].score - runner_up);
+  return AI_RESULT_OK;
+}
+
+#define MAX_DRAFT_TOKENS 16
+
+typedef struct {
+  // Position of the last token decoded in the sequence
+  llama_pos position;
+  // Index of its logits in the last batch. The logits of the drafts following
+  // it are stored right after.
+  int32_t logits;
+  llama_token drafts[MAX_DRAFT_TOKENS];
+  uint32_t drafted;
+  // Position of the next token to be decoded by the draft model, how many
+  // tokens it may still propose, and where to sample them from
+  llama_pos draft_position;
+  uint32_t draft_limit;
+  int32_t draft_logits;
+  // Tokens generated so far, replayed to the draft model when it falls behind
+  tokens_t *tokens;
+  bool active;
+} candidate_t;
+
+static void candidatesDestroy(candidate_t **self, size_t count) {
+  if (!self || !*self)
+    return;
+
+  for (size_t i = 0; i < count; i++) {
+    tokensDestroy(&(*self)[i].tokens);
+  }
+  deallocate(self);
+}
+
+static candidate_t *candidatesCreate(size_t count, size_t cap) {
+  candidate_t *candidates = allocate(sizeof(candidate_t) * count);
+  if (!candidates) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    candidates[i].tokens = tokensCreate(cap);
+    if (!candidates[i].tokens) {
+      candidatesDestroy(&candidates, count);
+      return NULL;
+    }
+  }
+  return candidates;
+}
+
+static void batchAdd(llama_batch *batch, llama_token token, llama_pos position,
+                     size_t sequence, bool logits) {
+  const int32_t n = batch->n_tokens;
+  batch->token[n] = token;
+  batch->pos[n] = position;
+  batch->n_seq_id[n] = 1;
+  batch->seq_id[n][0] = (llama_seq_id)sequence;
+  batch->logits[n] = logits;
+  batch->n_tokens++;
+}
+
+// Scores the tokens of the labels, each on its own sequence, in one batch. The
+// first token is scored beforehand, from the logits of the prompt.
+static ai_result_t rankBatch(ai_t *ai, label_t *labels, size_t count,
+                             llama_pos prompt_length, llama_token end) {
+  llama_memory_t memory = llama_get_memory(ai->context);
+  int32_t batch_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    batch_size += (int32_t)labels[i].len;
+    if (i > 0) {
+      // The first sequence holds just the prompt: copying part of a sequence
+      // is only supported with a unified KV cache
+      llama_memory_seq_rm(memory, (llama_seq_id)i, -1, -1);
+      llama_memory_seq_cp(memory, 0, (llama_seq_id)i, -1, -1);
+    }
+  }
+
+  llama_batch batch = llama_batch_init(batch_size, 0, 1);
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < labels[i].len; j++) {
+      batchAdd(&batch, labels[i].tokens[j], prompt_length + (llama_pos)j, i,
+               true);
+    }
+  }
+
+  if (llama_decode(ai->context, batch) != 0) {
+    llama_batch_free(batch);
+    aiClear(ai);
+    return AI_RESULT_ERROR_BATCH_DECODING_FAILED;
+  }
+
+  // Each token predicts the next one, the last one predicts the end
+  const int32_t vocabulary_size = llama_vocab_n_tokens(ai->vocabulary);
+  int32_t index = 0;
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < labels[i].len; j++, index++) {
+      if (j + 1 == labels[i].len && labels[i].truncated)
+        continue;
+      const float *logits = llama_get_logits_ith(ai->context, index);
+      const llama_token next =
+          j + 1 < labels[i].len ? labels[i].tokens[j + 1] : end;
+      labels[i].score +=
+          (double)logits[next] - logNormalizer(logits, vocabulary_size);
+    }
+  }
+  llama_batch_free(batch);
+
+  // Only the prompt is left, on the first sequence
+  for (size_t i = 0; i < count; i++) {
+    llama_memory_seq_rm(memory, (llama_seq_id)i, i > 0 ? -1 : prompt_length,
+                        -1);
+  }
+  return AI_RESULT_OK;
+}
+
+ai_result_t aiRank(ai_t *ai, tokens_t *prompt, const char *const *labels,
+                   size_t count, size_t *best, float *confidence) {
+  if (count == 0) {
+    return AI_RESULT_ERROR;
+  }
+
+  label_t *candidates = allocate(sizeof(label_t) * count);
+  if (!candidates) {
+    return AI_RESULT_ERROR_ALLOCATION_FAILED;
+  }
+
+  ai_result_t result = AI_RESULT_OK;
+  for (size_t i = 0; i < count && result == AI_RESULT_OK; i++) {
+    result =
+        tokenizeLabel(ai, labels[i], strlen(labels[i]), &candidates[i]);
+  }
+
+  if (result == AI_RESULT_OK) {
+    result = prefill(ai, prompt);
+  }
+
+  const llama_pos prompt_length = (llama_pos)prompt->len;
+  if (result == AI_RESULT_OK) {
+    size_t longest = 0;
+    for (size_t i = 0; i < count; i++) {
+      longest = candidates[i].len > longest ? candidates[i].len : longest;
+    }
+    if ((size_t)prompt_length + longest > ai->configuration->context_size) {
+      result = AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+    }
+  }
+
+  if (result == AI_RESULT_OK) {
+    const float *logits = llama_get_logits_ith(ai->context, -1);
+    const double normalizer =
+        logNormalizer(logits, llama_vocab_n_tokens(ai->vocabulary));
+    for (size_t i = 0; i < count; i++) {
+      candidates[i].score =
+          (double)logits[candidates[i].tokens[0]] - normalizer;
+    }
+  }
+
+  // As many labels as there are sequences are scored at once
+  const size_t sequences = llama_n_seq_max(ai->context);
+  for (size_t i = 0; i < count && result == AI_RESULT_OK; i += sequences) {
+    const size_t batch_count =
+        count - i < sequences ? count - i : sequences;
+    result = rankBatch(ai, candidates + i, batch_count, prompt_length,
+                       endToken(ai));
+  }
+
+  if (result != AI_RESULT_OK) {
+    deallocate(&candidates);
+    return result;
+  }
+
+  *best = 0;
+  for (size_t i = 1; i < count; i++) {
+    if (candidates[i].score > candidates[*best].score)
+      *best = i;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum += exp(candidates[i].score - candidates[*best].score);
+  }
+  *confidence = (float)(1.0 / sum);
+
+  deallocate(&candidates);
+  return AI_RESULT_OK;
+}
+
+// How many drafts can follow the last token, to fit both context and batch
+static uint32_t draftLimit(const ai_t *ai, const candidate_t *candidate) {
+  const llama_pos room = (llama_pos)ai->configuration->context_size - 1 -
+                         candidate->position;
+  uint32_t limit = ai->configuration->draft_tokens < MAX_DRAFT_TOKENS
+                       ? ai->configuration->draft_tokens
+                       : MAX_DRAFT_TOKENS;
+  if ((llama_pos)limit > room) {
+    limit = room > 0 ? (uint32_t)room : 0;
+  }
+  return limit;
+}
+
+// Lets the draft model greedily propose the tokens following the last one of
+// each active candidate. The draft context is first brought in sync with what
+// the main model accepted. Returns false if the draft model cannot be used.
+static bool draftTokens(ai_t *ai, candidate_t *candidates, size_t count,
+                        llama_pos prompt_length, llama_batch *batch) {
+  llama_memory_t memory = llama_get_memory(ai->draft_context);
+
+  for (size_t i = 0; i < count; i++) {
+    candidate_t *candidate = &candidates[i];
+    candidate->drafted = 0;
+    candidate->draft_limit = 0;
+    if (!candidate->active)
+      continue;
+
+    const uint32_t limit = draftLimit(ai, candidate);
+    if (limit == 0)
+      continue;
+
+    // Drop the rejected drafts, then replay what the draft model did not see
+    llama_pos from = candidate->draft_position < candidate->position
+                         ? candidate->draft_position
+                         : candidate->position;
+    llama_memory_seq_rm(memory, (llama_seq_id)i, from, -1);
+
+    // A long way behind, the draft model catches up on batches of its own
+    // instead of giving up on the candidate for the rest of the generation
+    while (candidate->position - from >= MAX_DRAFT_TOKENS) {
+      batch->n_tokens = 0;
+      for (llama_pos k = 0; k < MAX_DRAFT_TOKENS; k++) {
+        llama_token token =
+            bufAt(candidate->tokens, (size_t)(from + k - prompt_length));
+        batchAdd(batch, token, from + k, i, false);
+      }
+      if (llama_decode(ai->draft_context, *batch) != 0) {
+        return false;
+      }
+      from += MAX_DRAFT_TOKENS;
+    }
+    candidate->draft_position = from;
+    candidate->draft_limit = limit;
+  }
+
+  batch->n_tokens = 0;
+  for (size_t i = 0; i < count; i++) {
+    candidate_t *candidate = &candidates[i];
+    if (candidate->draft_limit == 0)
+      continue;
+
+    for (llama_pos position = candidate->draft_position;
+         position <= candidate->position;
+         position++) {
+      llama_token token =
+          bufAt(candidate->tokens, (size_t)(position - prompt_length));
+      batchAdd(batch, token, position, i, position == candidate->position);
+    }
+    candidate->draft_position = candidate->position + 1;
+    candidate->draft_logits = batch->n_tokens - 1;
+  }
+
+  while (batch->n_tokens > 0) {
+    if (llama_decode(ai->draft_context, *batch) != 0) {
+      return false;
+    }
+
+    batch->n_tokens = 0;
+    for (size_t i = 0; i < count; i++) {
+      candidate_t *candidate = &candidates[i];
+      if (candidate->drafted >= candidate->draft_limit)
+        continue;
+
+      llama_token token = llama_sampler_sample(
+          ai->draft_sampler, ai->draft_context, candidate->draft_logits);
+      if (llama_vocab_is_eog(ai->vocabulary, token)) {
+        candidate->draft_limit = candidate->drafted;
+        continue;
+      }
+
+      candidate->drafts[candidate->drafted++] = token;
+      if (candidate->drafted < candidate->draft_limit) {
+        batchAdd(batch, token, candidate->draft_position++, i, true);
+        candidate->draft_logits = batch->n_tokens - 1;
+      }
+    }
+  }
+  return true;
+}
+
+#define NGRAM_MAX 3
+
+static llama_token tokenAt(const ai_t *ai, const candidate_t *candidate,
+                           llama_pos prompt_length, llama_pos position) {
+  return position < prompt_length
+             ? bufAt(ai->cache, (size_t)position)
+             : bufAt(candidate->tokens, (size_t)(position - prompt_length));
+}
+
+// Proposes the tokens following the latest occurrence in the prompt of the
+// last few tokens of each active candidate. Narration mostly copies names and
+// descriptions from the prompt, so these are often right.
+static void lookupTokens(ai_t *ai, candidate_t *candidates, size_t count,
+                         llama_pos prompt_length) {
+  for (size_t i = 0; i < count; i++) {
+    candidate_t *candidate = &candidates[i];
+    candidate->drafted = 0;
+    if (!candidate->active)
+      continue;
+
+    const uint32_t limit = draftLimit(ai, candidate);
+    const llama_pos last = candidate->position;
+
+    // Longer n-grams are less ambiguous, so they are tried first
+    for (llama_pos n = NGRAM_MAX; n > 0 && candidate->drafted == 0; n--) {
+      if (last + 1 < n)
+        continue;
+
+      for (llama_pos start = prompt_length - n - 1; start >= 0; start--) {
+        llama_pos k = 0;
+        while (k < n && bufAt(ai->cache, (size_t)(start + k)) ==
+                            tokenAt(ai, candidate, prompt_length,
+                                    last - n + 1 + k)) {
+          k++;
+        }
+        if (k < n)
+          continue;
+
+        for (llama_pos next = start + n;
+             next < prompt_length && candidate->drafted < limit; next++) {
+          candidate->drafts[candidate->drafted++] =
+              bufAt(ai->cache, (size_t)next);
+        }
+        break;
+      }
+    }
+  }
+}
+
+ai_result_t aiGenerateCandidates(ai_t *ai, tokens_t *prompt,
+                                 strings_t *responses,
+                                 ai_token_callback_t callback, void *data,
+                                 size_t *accepted) {
+  const size_t count = responses->len < ai->samplers->len
+                           ? responses->len
+                           : ai->samplers->len;
+  panicif(count == 0, "need at least one candidate");
+
+  ai_result_t result = prefill(ai, prompt);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+
+  const llama_pos prompt_length = (llama_pos)ai->cache->len;
+  const llama_pos context_size = (llama_pos)ai->configuration->context_size;
+
+  candidate_t *candidates =
+      candidatesCreate(count, (size_t)(context_size - prompt_length));
+  if (!candidates) {
+    return AI_RESULT_ERROR_ALLOCATION_FAILED;
+  }
+
+  // Every candidate may submit its last token along with its drafts
+  const int32_t batch_size = (int32_t)count * (MAX_DRAFT_TOKENS + 1);
+  llama_batch batch = llama_batch_init(batch_size, 0, 1);
+  llama_batch draft_batch = llama_batch_init(batch_size, 0, 1);
+  llama_memory_t memory = llama_get_memory(ai->context);
+  llama_memory_t draft_memory =
+      ai->draft_context ? llama_get_memory(ai->draft_context) : NULL;
+  const bool speculate = ai->configuration->draft_tokens > 0;
+
+  // Candidates share the prompt decoded on the first sequence
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      llama_memory_seq_rm(memory, (llama_seq_id)i, -1, -1);
+      llama_memory_seq_cp(memory, 0, (llama_seq_id)i, -1, -1);
+      if (draft_memory) {
+        llama_memory_seq_rm(draft_memory, (llama_seq_id)i, -1, -1);
+        llama_memory_seq_cp(draft_memory, 0, (llama_seq_id)i, -1, -1);
+      }
+    }
+    candidates[i].position = prompt_length - 1;
+    candidates[i].logits = -1;
+    candidates[i].drafted = 0;
+    candidates[i].draft_position = prompt_length;
+    candidates[i].active = true;
+    strClear(bufAt(responses, i));
+  }
+
+  result = AI_RESULT_ERROR_INVALID_OUTPUT_DETECTED;
+  size_t active = count;
+  while (active > 0) {
+    for (size_t i = 0; i < count; i++) {
+      candidate_t *candidate = &candidates[i];
+      if (!candidate->active)
+        continue;
+
+      // The main model samples after the last token and after each draft, as
+      // long as the drafts match what it samples. The outcome is the same as
+      // sampling one token at a time.
+      string_t *response = bufAt(responses, i);
+      for (uint32_t j = 0; j <= candidate->drafted; j++) {
+        const int32_t index =
+            candidate->logits < 0 ? -1 : candidate->logits + (int32_t)j;
+        const llama_pos position = candidate->position + 1 + (llama_pos)j;
+        llama_token token_id =
+            llama_sampler_sample(bufAt(ai->samplers, i), ai->context, index);
+
+        ai_step_t step = AI_STEP_TOKEN;
+        if (llama_vocab_is_eog(ai->vocabulary, token_id)) {
+          step = AI_STEP_END;
+        } else if (appendToken(ai, token_id, response) != AI_RESULT_OK ||
+                   position >= context_size) {
+          step = AI_STEP_INTERRUPTED;
+        }
+
+        ai_verdict_t verdict = AI_VERDICT_CONTINUE;
+        if (callback) {
+          verdict = callback(i, response, step, data);
+        } else if (step == AI_STEP_END) {
+          verdict = AI_VERDICT_ACCEPT;
+        }
+
+        if (verdict == AI_VERDICT_ACCEPT) {
+          *accepted = i;
+          result = AI_RESULT_OK;
+          goto cleanup;
+        }
+
+        if (verdict == AI_VERDICT_REJECT || step != AI_STEP_TOKEN) {
+          candidate->active = false;
+          active--;
+          break;
+        }
+
+        ai->stats.generated++;
+        bufPush(candidate->tokens, token_id);
+        if (j < candidate->drafted && token_id == candidate->drafts[j]) {
+          ai->stats.accepted++;
+          continue;
+        }
+
+        // The token is decoded in the next batch, replacing the first
+        // rejected draft and whatever follows it
+        llama_memory_seq_rm(memory, (llama_seq_id)i, position, -1);
+        candidate->position = position;
+        break;
+      }
+    }
+
+    if (active == 0)
       break;
+
+    if (speculate && draft_memory &&
+        !draftTokens(ai, candidates, count, prompt_length, &draft_batch)) {
+      // Drafts are just a shortcut: the prompt is the next best source
+      llama_memory_clear(draft_memory, true);
+      ai->draft_cache->len = 0;
+      draft_memory = NULL;
+    }
+    if (speculate && !draft_memory) {
+      lookupTokens(ai, candidates, count, prompt_length);
     }
 
-    char parsed_token[256] = {};
-    int32_t offset = llama_token_to_piece(
-        ai->vocabulary, token_id, parsed_token, sizeof(parsed_token), 0, false);
+    batch.n_tokens = 0;
+    for (size_t i = 0; i < count; i++) {
+      candidate_t *candidate = &candidates[i];
+      if (!candidate->active)
+        continue;
 
-    if (offset < 0) {
-      deallocate(&tokens);
-      return AI_RESULT_ERROR_TOKEN_PARSING_FAILED;
+      candidate->logits = batch.n_tokens;
+      batchAdd(&batch, bufAt(candidate->tokens, candidate->tokens->len - 1),
+               candidate->position, i, true);
+      for (uint32_t j = 0; j < candidate->drafted; j++) {
+        batchAdd(&batch, candidate->drafts[j],
+                 candidate->position + 1 + (llama_pos)j, i, true);
+      }
+      ai->stats.drafted += candidate->drafted;
+      ai->stats.steps++;
     }
 
-    if (containsStopChar(parsed_token)) {
-      deallocate(&tokens);
-      return AI_RESULT_ERROR_INVALID_OUTPUT_DETECTED;
+    if (llama_decode(ai->context, batch) != 0) {
+      result = AI_RESULT_ERROR_BATCH_DECODING_FAILED;
+      break;
     }
+  }
 
-    if (response->len + (size_t)offset > response->cap) {
-      deallocate(&tokens);
-      return AI_RESULT_ERROR_RESPONSE_LENGTH_EXCEEDED;
+cleanup:
+  // Only the prompt survives in the cache, ready for the next attempt
+  for (size_t i = 1; i < count; i++) {
+    llama_memory_seq_rm(memory, (llama_seq_id)i, -1, -1);
+    if (draft_memory) {
+      llama_memory_seq_rm(draft_memory, (llama_seq_id)i, -1, -1);
     }
+  }
+  if (draft_memory) {
+    llama_memory_seq_rm(draft_memory, 0, prompt_length, -1);
+    ai->draft_cache->len = (size_t)prompt_length;
+  }
+  if (result == AI_RESULT_ERROR_BATCH_DECODING_FAILED) {
+    aiClear(ai);
+  } else {
+    llama_memory_seq_rm(memory, 0, prompt_length, -1);
+    ai->cache->len = (size_t)prompt_length;
+  }
+
+  llama_batch_free(batch);
+  llama_batch_free(draft_batch);
+  candidatesDestroy(&candidates, count);
+  return result;
+}
 
-    strFmtAppend(response, "%s", parsed_token);
-    batch = llama_batch_get_one(&token_id, 1);
+size_t aiEmbeddingSize(const ai_t *self) {
+  return (size_t)llama_model_n_embd(self->model);
+}
+
+ai_result_t aiEmbed(ai_t *self, const char *text, float *embedding) {
+  const uint32_t context_size = self->configuration->context_size;
+  if (!self->embedding_context) {
+    // Pooling needs every token of the text in the same batch
+    struct llama_context_params params = llama_context_default_params();
+    params.n_ctx = context_size;
+    params.n_batch = context_size;
+    params.n_ubatch = context_size;
+    params.n_seq_max = 1;
+    params.embeddings = true;
+    params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+    self->embedding_context = llama_init_from_model(self->model, params);
+    if (!self->embedding_context) {
+      return AI_RESULT_ERROR_CREATE_CONTEXT_FAILED;
+    }
+  }
+
+  if (!self->embedding_tokens) {
+    self->embedding_tokens = tokensCreate(context_size);
+    if (!self->embedding_tokens) {
+      return AI_RESULT_ERROR_ALLOCATION_FAILED;
+    }
   }
 
+  tokens_t *tokens = self->embedding_tokens;
+  tokens->len = 0;
+  ai_result_t result = aiPromptAppendText(self, tokens, text);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+  if (tokens->len == 0) {
+    return AI_RESULT_ERROR_TOKENIZATION_FAILED;
+  }
+
+  // Texts are unrelated to each other: nothing is kept between them
+  llama_memory_clear(llama_get_memory(self->embedding_context), true);
+  llama_batch batch = llama_batch_get_one(tokens->data, (int32_t)tokens->len);
+  if (llama_decode(self->embedding_context, batch) != 0) {
+    return AI_RESULT_ERROR_BATCH_DECODING_FAILED;
+  }
+
+  const float *pooled = llama_get_embeddings_seq(self->embedding_context, 0);
+  if (!pooled) {
+    return AI_RESULT_ERROR;
+  }
+
+  const size_t size = aiEmbeddingSize(self);
+  double norm = 0;
+  for (size_t i = 0; i < size; i++) {
+    norm += (double)pooled[i] * (double)pooled[i];
+  }
+  const float scale = norm > 0 ? (float)(1.0 / sqrt(norm)) : 0;
+  for (size_t i = 0; i < size; i++) {
+    embedding[i] = pooled[i] * scale;
+  }
   return AI_RESULT_OK;
 }
 
-ai_result_t aiSetGrammar(ai_t *self, string_t *grammar) {
-  self->configuration->grammar = grammar;
-  llama_memory_clear(llama_get_memory(self->context), true);
-  return initSampler(self, self->configuration);
+ai_result_t aiSetGrammar(ai_t *self, const string_t *grammar) {
+  if (self->choices) {
+    bufClear(self->choices, (trie_node_t){});
+    strDestroy(&self->choices_text);
+  }
+  return useGrammar(self, grammar);
+}
+
+static trie_t *trieCreate(size_t cap) {
+  trie_t *trie = NULL;
+  bufCreate(trie_t, trie_node_t, trie, cap);
+  return trie;
+}
+
+// Adds the path of the tokens to the trie, sharing the longest existing prefix
+static ai_result_t trieAdd(trie_t *trie, const llama_token *tokens,
+                           size_t len) {
+  uint32_t node = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint32_t child = bufAt(trie, node).child;
+    size_t branches = 0;
+    while (child != 0 && bufAt(trie, child).token != tokens[i]) {
+      child = bufAt(trie, child).sibling;
+      branches++;
+    }
+
+    if (child == 0) {
+      if (trie->len == trie->cap || branches == AI_CHOICE_BRANCHES) {
+        return AI_RESULT_ERROR_CONTEXT_LENGTH_EXCEEDED;
+      }
+      child = (uint32_t)trie->len;
+      trie_node_t added = {tokens[i], 0, bufAt(trie, node).child, false};
+      bufPush(trie, added);
+      trie->data[node].child = child;
+    }
+    node = child;
+  }
+  trie->data[node].terminal = true;
+  return AI_RESULT_OK;
+}
+
+ai_result_t aiSetChoices(ai_t *self, const string_t *choices) {
+  if (!self->choices) {
+    self->choices = trieCreate(AI_CHOICE_NODES);
+    if (!self->choices) {
+      return AI_RESULT_ERROR_ALLOCATION_FAILED;
+    }
+  }
+
+  if (!self->choices_text || !strEq(self->choices_text, choices)) {
+    strDestroy(&self->choices_text);
+    bufClear(self->choices, (trie_node_t){});
+    self->choices_text = strDup(choices);
+    if (!self->choices_text) {
+      return AI_RESULT_ERROR_ALLOCATION_FAILED;
+    }
+
+    bufPush(self->choices, (trie_node_t){});
+    const char *line = choices->data;
+    while (*line) {
+      const char *newline = strchr(line, '\n');
+      const size_t len = newline ? (size_t)(newline - line) : strlen(line);
+
+      llama_token tokens[AI_CHOICE_TOKENS];
+      const int32_t count =
+          llama_tokenize(self->vocabulary, line, (int32_t)len, tokens,
+                         AI_CHOICE_TOKENS, false, false);
+      ai_result_t result = count < 0 ? AI_RESULT_ERROR_TOKENIZATION_FAILED
+                                     : trieAdd(self->choices, tokens,
+                                               (size_t)count);
+      if (result != AI_RESULT_OK) {
+        // Never leave a trie that allows only some of the choices
+        bufClear(self->choices, (trie_node_t){});
+        strDestroy(&self->choices_text);
+        return result;
+      }
+      line += newline ? len + 1 : len;
+    }
+  }
+
+  // Choices are enforced by the trie: the samplers need no grammar
+  return useGrammar(self, NULL);
 }
 
 ai_result_t aiReset(ai_t *self) {
+  size_t i = 0;
+  bufEach(self->samplers, i) { llama_sampler_reset(bufAt(self->samplers, i)); }
+  return AI_RESULT_OK;
+}
+
+// Drops the span from the first sequence, shifting back what follows it
+static void forgetSpan(struct llama_context *context, tokens_t *cache,
+                       size_t from, size_t to) {
+  if (to > cache->len) {
+    to = cache->len;
+  }
+  if (from >= to) {
+    return;
+  }
+
+  llama_memory_t memory = llama_get_memory(context);
+  if (!llama_memory_can_shift(memory) ||
+      !llama_memory_seq_rm(memory, 0, (llama_pos)from, (llama_pos)to)) {
+    // Whatever follows the span will be decoded again
+    if (!llama_memory_seq_rm(memory, 0, (llama_pos)from, -1)) {
+      llama_memory_clear(memory, true);
+      from = 0;
+    }
+    cache->len = from;
+    return;
+  }
+
+  llama_memory_seq_add(memory, 0, (llama_pos)to, -1, -(llama_pos)(to - from));
+  memmove(cache->data + from, cache->data + to,
+          sizeof(llama_token) * (cache->len - to));
+  cache->len -= to - from;
+}
+
+void aiForget(ai_t *self, size_t from, size_t to) {
+  forgetSpan(self->context, self->cache, from, to);
+  if (self->draft_context) {
+    forgetSpan(self->draft_context, self->draft_cache, from, to);
+  }
+}
+
+void aiClear(ai_t *self) {
   llama_memory_clear(llama_get_memory(self->context), true);
-  return initSampler(self, self->configuration);
+  self->cache->len = 0;
+
+  if (self->draft_context) {
+    llama_memory_clear(llama_get_memory(self->draft_context), true);
+    self->draft_cache->len = 0;
+  }
 }
 
 void aiDestroy(ai_t **self) {
@@ -196,16 +1539,34 @@ void aiDestroy(ai_t **self) {
   // TODO: ggml stuff is leaking, but I cannot understand how to free it
   // It's currently ignored in asan.supp
 
-  llama_sampler_free((*self)->sampler);
-  (*self)->sampler = NULL;
+  for (size_t i = 0; i < arrLen((*self)->grammars); i++) {
+    grammarEntryClear(&(*self)->grammars[i]);
+  }
+  (*self)->samplers = NULL;
+  strDestroy(&(*self)->choices_text);
+  deallocate(&(*self)->choices);
 
   llama_free((*self)->context);
   (*self)->context = NULL;
+  llama_free((*self)->embedding_context);
+  (*self)->embedding_context = NULL;
+  tokensDestroy(&(*self)->embedding_tokens);
 
-  llama_model_free((*self)->model);
-  (*self)->model = NULL;
+  modelRelease(&(*self)->model);
+  tokensDestroy(&(*self)->cache);
+  for (size_t i = 0; i < PROMPT_TYPES; i++) {
+    tokensDestroy(&(*self)->template_heads[i]);
+    tokensDestroy(&(*self)->template_tails[i]);
+  }
 
-  llama_backend_free();
+  if ((*self)->draft_sampler) {
+    llama_sampler_free((*self)->draft_sampler);
+    (*self)->draft_sampler = NULL;
+  }
+  llama_free((*self)->draft_context);
+  (*self)->draft_context = NULL;
+  modelRelease(&(*self)->draft_model);
+  tokensDestroy(&(*self)->draft_cache);
   deallocate(self);
 }
 
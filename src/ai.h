@@ -2,6 +2,7 @@
 
 #include "lib/buffers.h"
 #include <llama.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef enum {
@@ -38,19 +39,190 @@ typedef struct {
   uint32_t context_size;
   int32_t top_k;
   uint32_t seed;
+  // How many responses aiGenerateCandidates samples in parallel
+  uint32_t candidates;
+  // Up to draft_tokens tokens are proposed and verified in a single batch by
+  // the main model. They come from an optional smaller model sharing the
+  // vocabulary of the main one or, without it, are copied from the prompt.
+  const char *draft_path;
+  uint32_t draft_tokens;
+  // How many labels aiRank scores in a single batch, each on its own sequence
+  uint32_t ranked;
 } config_t;
 
+typedef Buffer(llama_token) tokens_t;
+typedef Buffer(struct llama_sampler *) samplers_t;
+
+// Sampler chains built for a grammar, one per candidate
+typedef struct {
+  // Owned copy of the grammar text. NULL for unconstrained sampling
+  string_t *grammar;
+  samplers_t *samplers;
+  // Recency of use, for eviction
+  uint64_t used;
+} grammar_entry_t;
+
+#define AI_GRAMMARS 16
+
+// Node of a trie of tokenized choices. Children are linked through their
+// siblings; index 0 is the root, so it also marks the end of a list.
+typedef struct {
+  llama_token token;
+  uint32_t child;
+  uint32_t sibling;
+  // A choice ends here
+  bool terminal;
+} trie_node_t;
+
+typedef Buffer(trie_node_t) trie_t;
+
+// Most tokens stored in the trie, in a single choice, and following a node
+#define AI_CHOICE_NODES 4096
+#define AI_CHOICE_TOKENS 64
+#define AI_CHOICE_BRANCHES 256
+
+typedef struct {
+  // Tokens proposed as drafts and verified by the main model
+  size_t drafted;
+  // Proposed tokens that matched what the main model sampled
+  size_t accepted;
+  // Tokens generated across all candidates and forward passes of the main
+  // model spent on them, per sequence. Without drafts they are the same.
+  size_t generated;
+  size_t steps;
+} ai_stats_t;
+
 typedef struct {
+  // Shared by all the instances created from the same model path
   struct llama_model *model;
   const struct llama_vocab *vocabulary;
   struct llama_context *context;
-  struct llama_sampler *sampler;
+  // One sampler per candidate sequence for the current grammar. The first one
+  // is used by aiGenerate. It points into the cache below
+  samplers_t *samplers;
+  grammar_entry_t grammars[AI_GRAMMARS];
+  uint64_t grammar_clock;
+  // Outputs allowed by aiSetChoices, as given and tokenized. Empty when the
+  // output is constrained by the grammar instead.
+  string_t *choices_text;
+  trie_t *choices;
   config_t *configuration;
+  // Tokens currently stored in the KV cache. Subsequent generations only
+  // decode what follows the longest prefix shared with this sequence.
+  tokens_t *cache;
+  // Prompt templates split around their placeholder, already tokenized
+  tokens_t *template_heads[PROMPT_TYPES];
+  tokens_t *template_tails[PROMPT_TYPES];
+  // Same as the model, context and cache above, for the optional draft model
+  struct llama_model *draft_model;
+  struct llama_context *draft_context;
+  struct llama_sampler *draft_sampler;
+  tokens_t *draft_cache;
+  // Speculative decoding counters, accumulated by aiGenerateCandidates
+  ai_stats_t stats;
+  // Context of the same model pooling its hidden states into embeddings,
+  // created on first use
+  struct llama_context *embedding_context;
+  tokens_t *embedding_tokens;
 } ai_t;
 
 __attribute__((warn_unused_result)) ai_t *aiCreate(config_t *, ai_result_t *);
 void aiDestroy(ai_t **);
 
-ai_result_t aiGenerate(ai_t *, const string_t *, string_t *);
-ai_result_t aiSetGrammar(ai_t *, string_t *);
+// Prompts are token buffers as large as the context, assembled from segments.
+// Segments that never change can be tokenized once and appended many times.
+tokens_t *aiPromptCreate(const ai_t *);
+void aiPromptDestroy(tokens_t **);
+// Appends the text, tokenized as plain text: special tokens are not parsed
+ai_result_t aiPromptAppendText(const ai_t *, tokens_t *, const char *);
+// Appends the text wrapped in the configured template of the given type
+ai_result_t aiPromptAppend(const ai_t *, tokens_t *, prompt_type_t,
+                           const char *);
+// Appends the text after the head of the template of the given type, without
+// the tail: the message is left open, as if more text was coming
+ai_result_t aiPromptAppendOpen(const ai_t *, tokens_t *, prompt_type_t,
+                               const char *);
+ai_result_t aiPromptAppendTokens(tokens_t *, const tokens_t *);
+
+// Decodes the prompt into the KV cache without generating anything, so that
+// following prompts starting with it only decode what comes after. Whatever
+// the cache holds past the prefix shared with the prompt is dropped.
+ai_result_t aiPrefill(ai_t *, tokens_t *);
+
+ai_result_t aiGenerate(ai_t *, tokens_t *, string_t *);
+
+typedef enum {
+  // A token was appended to the response
+  AI_STEP_TOKEN,
+  // The response is complete
+  AI_STEP_END,
+  // The response was cut short by an invalid token or by the length limits
+  AI_STEP_INTERRUPTED,
+} ai_step_t;
+
+typedef enum {
+  AI_VERDICT_CONTINUE,
+  // Stop generating the candidate and discard it
+  AI_VERDICT_REJECT,
+  // Stop generating and return the candidate as it is
+  AI_VERDICT_ACCEPT,
+} ai_verdict_t;
+
+// Follows a candidate response while it is generated. Invoked with the index
+// of the candidate after every token and once more when it ends. The response
+// can be edited before accepting it. A CONTINUE at the end means REJECT.
+typedef ai_verdict_t (*ai_token_callback_t)(size_t, string_t *, ai_step_t,
+                                            void *);
+
+// Decodes the prompt once and samples one candidate response per string in
+// the provided list (up to the configured number of candidates) in a single
+// batch. Returns as soon as the callback accepts one of them, storing its index
+// in the last argument. Without callback, the first complete response wins.
+// Fails with AI_RESULT_ERROR_INVALID_OUTPUT_DETECTED if all are rejected.
+ai_result_t aiGenerateCandidates(ai_t *, tokens_t *, strings_t *,
+                                 ai_token_callback_t, void *, size_t *);
+
+// Most labels aiClassify chooses among, and most tokens of each that are
+// scored: longer labels are scored by their first tokens
+#define AI_LABELS 16
+#define AI_LABEL_TOKENS 16
+
+// Scores each label as the response to the prompt by the probability of its
+// tokens, without sampling. Labels starting with the same tokens share their
+// evaluation: when none is a prefix of another and all are single tokens, the
+// prompt is the only thing decoded. Stores the index of the most likely label
+// and by how much its log-probability exceeds the runner-up's.
+ai_result_t aiClassify(ai_t *, tokens_t *, string_t *const *, size_t, size_t *,
+                       float *);
+
+// Scores each label as the response to the prompt like aiClassify, but every
+// label is evaluated on its own sequence of a single batch, so the time taken
+// does not depend on their length. Stores the index of the most likely label
+// and its probability among all the labels.
+ai_result_t aiRank(ai_t *, tokens_t *, const char *const *, size_t, size_t *,
+                   float *);
+
+// Length of the embeddings written by aiEmbed
+size_t aiEmbeddingSize(const ai_t *);
+// Writes the embedding of the text, the mean of the hidden states of its
+// tokens, scaled to unit length: the dot product of two embeddings is their
+// cosine similarity.
+ai_result_t aiEmbed(ai_t *, const char *, float *);
+
+// Replaces the grammar constraining the output and resets the samplers. Chains
+// for recently used grammars are cached and reused. The KV cache is preserved.
+ai_result_t aiSetGrammar(ai_t *, const string_t *);
+// Constrains the output to one of the newline-separated choices, replacing the
+// grammar. Tokens with a single possible continuation are appended without
+// sampling, and generation stops without decoding once the output is complete.
+// The trie of choices is only rebuilt when they change.
+ai_result_t aiSetChoices(ai_t *, const string_t *);
+// Resets the sampler state (grammar, penalties, and random seed). The KV cache
+// is preserved, so the following generation reuses the already decoded prompt.
 ai_result_t aiReset(ai_t *);
+// Drops the tokens between the given positions from the KV cache. Following
+// tokens are shifted back, so a prompt leaving out the same span still reuses
+// them, without decoding them again.
+void aiForget(ai_t *, size_t, size_t);
+// Wipes the KV cache. The next generation will decode the prompt from scratch.
+void aiClear(ai_t *);
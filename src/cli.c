@@ -18,8 +18,30 @@ void cliPromptInit(void) {
   linenoiseSetCompletionCallback(completion);
 }
 
-cli_readline_result_t cliReadline(string_t *input) {
-  char *line = linenoise("> ");
+#define CLI_LINE_LENGTH 512
+
+// Feeds linenoise one key at a time, to report the line after each of them.
+// Terminals linenoise cannot edit in are read from as usual.
+static char *readlineTyping(cli_typing_callback_t typing, void *data) {
+  char buffer[CLI_LINE_LENGTH];
+  struct linenoiseState state;
+  if (linenoiseEditStart(&state, -1, -1, buffer, sizeof(buffer), "> ") ==
+      -1) {
+    return linenoise("> ");
+  }
+
+  char *line = linenoiseEditFeed(&state);
+  while (line == linenoiseEditMore) {
+    typing(state.buf, data);
+    line = linenoiseEditFeed(&state);
+  }
+  linenoiseEditStop(&state);
+  return line;
+}
+
+cli_readline_result_t cliReadline(string_t *input, cli_typing_callback_t typing,
+                                  void *data) {
+  char *line = typing ? readlineTyping(typing, data) : linenoise("> ");
 
   // This is invoked on Ctrl+C/D
   if (!line) {
@@ -12,9 +12,13 @@ typedef enum {
   CLI_READLINE_RESULT_QUIT,
 } cli_readline_result_t;
 
+// Invoked with the line typed so far after every key press
+typedef void (*cli_typing_callback_t)(const char *, void *);
+
 // Initialize the CLI interface
 void cliPromptInit(void);
-cli_readline_result_t cliReadline(string_t *);
+// Reads a line. The callback, if any, follows the line while it is typed.
+cli_readline_result_t cliReadline(string_t *, cli_typing_callback_t, void *);
 
 void cliPrintError(const char *);
 void cliPrintUsageAndExit(void);
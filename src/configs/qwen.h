@@ -13,6 +13,13 @@ static const string_t PARSER_TARGET_SYS_PROMPT = strConst(
     "Choose the single best option that matches the user's "
     "intent. When there is no match, respond with 'unknown'.");
 
+static const string_t PARSER_COMMAND_SYS_PROMPT = strConst(
+    "You are a parser for a text adventure game. Rewrite the user's command "
+    "as one verb (move, take, drop, use, examine) followed by its target.\n"
+    "Users can use synonyms or describe things differently.\n"
+    "When something is used on something else, add 'on' and the second "
+    "target. When there is no match, respond with 'unknown'.");
+
 static const string_t MASTER_WORLD_DESC_SYS_PROMPT =
     strConst("You are the narrator of a text adventure. Write a "
              "short description based on provided data.\n"
@@ -46,14 +53,30 @@ static string_t RES_PROMPT = strConst("<|im_end|>\n<|im_start|>assistant\n%s");
 static string_t USR_PROMPT = strConst("<|im_end|>\n<|im_start|>user\n%s");
 static string_t SYS_PROMPT = strConst("<|im_start|>system\n%s");
 
+// Sequences of a context do not share KV cells: a context holds its context
+// size once per sequence. At 28 KiB a cell (qwen2.5 1.5B has 28 layers and 2
+// KV heads of 128, keys and values in f16) the KV caches take:
+//  - narrator: 2048 cells x 4 candidates = 8192 cells, 224 MiB
+//  - parser: 1024 cells x 4 ranked labels = 4096 cells, 112 MiB
+//  - parser embeddings, on a context of their own: 1024 cells, 28 MiB
+//  - second parser, only created to parse concurrently when the command
+//    choices do not fit: 4096 + 1024 cells, 140 MiB
+// That is 364 MiB, 504 MiB with the second parser, against 112 MiB for the
+// two single sequence contexts of 2048 cells the game started with.
+// The weights, about 1 GiB, are loaded once for every context.
 static config_t PARSER_CONFIG = {
     .path = "./models/qwen2.5-1.5b-instruct-q4_k_m.gguf",
     .min_p = 0,
     .temp = 0,
-    .context_size = 2048,
+    .context_size = 1024,
     .top_k = 1,
     .repetition_penalty = 1.0F,
     .seed = 0xFFFFFFFF,
+    .candidates = 1,
+    .draft_path = NULL,
+    .draft_tokens = 0,
+    // Target names are scored four at a time, each on its own sequence
+    .ranked = 4,
     .grammar = NULL,
     .prompt_templates =
         {
@@ -71,6 +94,12 @@ static config_t NARRATOR_CONFIG = {
     .top_k = 30,
     .repetition_penalty = 1.15F,
     .seed = 0,
+    .candidates = 4,
+    // Drafts are copied from the prompt unless a draft model is set, e.g.
+    // "./models/qwen2.5-0.5b-instruct-q4_k_m.gguf"
+    .draft_path = NULL,
+    .draft_tokens = 6,
+    .ranked = 0,
     .grammar = NULL,
     .prompt_templates =
         {
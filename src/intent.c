@@ -0,0 +1,333 @@
+#include "intent.h"
+#include "lib/alloc.h"
+#include "lib/panic.h"
+#include "utils.h"
+#include "world/object.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+  const char *text;
+  action_type_t action;
+} intent_example_t;
+
+// Commands players commonly type. Names are deliberately varied, so that only
+// the words describing the action are learnt.
+static intent_example_t corpus[] = {
+    {"go north", ACTION_TYPE_MOVE},
+    {"go to the cellar", ACTION_TYPE_MOVE},
+    {"walk into the library", ACTION_TYPE_MOVE},
+    {"head to the tower", ACTION_TYPE_MOVE},
+    {"head back to the courtyard", ACTION_TYPE_MOVE},
+    {"run away to the woods", ACTION_TYPE_MOVE},
+    {"travel towards the harbour", ACTION_TYPE_MOVE},
+    {"climb up to the attic", ACTION_TYPE_MOVE},
+    {"climb down the stairs", ACTION_TYPE_MOVE},
+    {"step into the chapel", ACTION_TYPE_MOVE},
+    {"proceed to the gate", ACTION_TYPE_MOVE},
+    {"return to the camp", ACTION_TYPE_MOVE},
+    {"let us go to the shore", ACTION_TYPE_MOVE},
+    {"exit towards the bridge", ACTION_TYPE_MOVE},
+    {"visit the market", ACTION_TYPE_MOVE},
+    {"wander into the meadow", ACTION_TYPE_MOVE},
+    {"sneak into the vault", ACTION_TYPE_MOVE},
+    {"hurry to the station", ACTION_TYPE_MOVE},
+
+    {"take the lamp", ACTION_TYPE_TAKE},
+    {"pick up the rope", ACTION_TYPE_TAKE},
+    {"pick the flower", ACTION_TYPE_TAKE},
+    {"grab the dagger", ACTION_TYPE_TAKE},
+    {"get the map", ACTION_TYPE_TAKE},
+    {"collect the coins", ACTION_TYPE_TAKE},
+    {"retrieve the scroll", ACTION_TYPE_TAKE},
+    {"snatch the ring", ACTION_TYPE_TAKE},
+    {"steal the crown", ACTION_TYPE_TAKE},
+    {"gather the herbs", ACTION_TYPE_TAKE},
+    {"pocket the gem", ACTION_TYPE_TAKE},
+    {"carry the box with me", ACTION_TYPE_TAKE},
+    {"acquire the amulet", ACTION_TYPE_TAKE},
+    {"obtain the potion", ACTION_TYPE_TAKE},
+    {"lift the stone and keep it", ACTION_TYPE_TAKE},
+    {"fetch the bucket", ACTION_TYPE_TAKE},
+    {"put the torch in my bag", ACTION_TYPE_TAKE},
+    {"add the feather to my inventory", ACTION_TYPE_TAKE},
+
+    {"drop the lamp", ACTION_TYPE_DROP},
+    {"put down the rope", ACTION_TYPE_DROP},
+    {"put the dagger on the floor", ACTION_TYPE_DROP},
+    {"set the map down", ACTION_TYPE_DROP},
+    {"place the coins on the table", ACTION_TYPE_DROP},
+    {"leave the scroll here", ACTION_TYPE_DROP},
+    {"discard the ring", ACTION_TYPE_DROP},
+    {"throw away the crown", ACTION_TYPE_DROP},
+    {"get rid of the herbs", ACTION_TYPE_DROP},
+    {"toss the gem", ACTION_TYPE_DROP},
+    {"abandon the box", ACTION_TYPE_DROP},
+    {"release the bird", ACTION_TYPE_DROP},
+    {"lay the amulet on the altar", ACTION_TYPE_DROP},
+    {"dump the potion", ACTION_TYPE_DROP},
+    {"let go of the stone", ACTION_TYPE_DROP},
+    {"empty my pockets", ACTION_TYPE_DROP},
+    {"unload the bucket", ACTION_TYPE_DROP},
+    {"remove the feather from my inventory", ACTION_TYPE_DROP},
+
+    {"use the lamp", ACTION_TYPE_USE},
+    {"light the torch", ACTION_TYPE_USE},
+    {"open the door", ACTION_TYPE_USE},
+    {"unlock the gate with the key", ACTION_TYPE_USE},
+    {"close the window", ACTION_TYPE_USE},
+    {"drink the potion", ACTION_TYPE_USE},
+    {"eat the apple", ACTION_TYPE_USE},
+    {"wear the amulet", ACTION_TYPE_USE},
+    {"press the switch", ACTION_TYPE_USE},
+    {"push the cart", ACTION_TYPE_USE},
+    {"pull the rope", ACTION_TYPE_USE},
+    {"turn the wheel", ACTION_TYPE_USE},
+    {"cut the vines with the dagger", ACTION_TYPE_USE},
+    {"play the flute", ACTION_TYPE_USE},
+    {"activate the machine", ACTION_TYPE_USE},
+    {"apply the ointment", ACTION_TYPE_USE},
+    {"utilize the crowbar", ACTION_TYPE_USE},
+    {"employ the map to find the way", ACTION_TYPE_USE},
+    {"fill the bucket with water", ACTION_TYPE_USE},
+    {"ring the bell", ACTION_TYPE_USE},
+
+    {"examine the lamp", ACTION_TYPE_EXAMINE},
+    {"look at the painting", ACTION_TYPE_EXAMINE},
+    {"look around", ACTION_TYPE_EXAMINE},
+    {"look closely at the carvings", ACTION_TYPE_EXAMINE},
+    {"inspect the dagger", ACTION_TYPE_EXAMINE},
+    {"study the map", ACTION_TYPE_EXAMINE},
+    {"read the scroll", ACTION_TYPE_EXAMINE},
+    {"check the ring", ACTION_TYPE_EXAMINE},
+    {"check out the statue", ACTION_TYPE_EXAMINE},
+    {"observe the stars", ACTION_TYPE_EXAMINE},
+    {"search the box", ACTION_TYPE_EXAMINE},
+    {"describe the amulet", ACTION_TYPE_EXAMINE},
+    {"what is this potion", ACTION_TYPE_EXAMINE},
+    {"peek inside the chest", ACTION_TYPE_EXAMINE},
+    {"analyze the stone", ACTION_TYPE_EXAMINE},
+    {"scan the room", ACTION_TYPE_EXAMINE},
+    {"view the inscription", ACTION_TYPE_EXAMINE},
+    {"watch the river", ACTION_TYPE_EXAMINE},
+};
+
+#define INTENT_MAX_FEATURES 256
+
+static size_t hashFeature(char kind, const char *text, size_t len) {
+  uint64_t hash = 14695981039346656037U;
+  const uint64_t prime = 1099511628211U;
+
+  hash ^= (uint64_t)(unsigned char)kind;
+  hash *= prime;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint64_t)(unsigned char)text[i];
+    hash *= prime;
+  }
+  return (size_t)(hash % INTENT_FEATURES);
+}
+
+static void addFeature(size_t *features, size_t *count, size_t feature) {
+  if (*count < INTENT_MAX_FEATURES) {
+    features[(*count)++] = feature;
+  }
+}
+
+// Extracts the buckets of the features of the text: the first word, every
+// word, every pair of adjacent words, and every character trigram of the
+// words padded with spaces. Returns the number of features.
+static size_t extractFeatures(const char *input, size_t *features) {
+  char text[OBJECT_NAME_NORMALIZED_LENGTH + 2] = " ";
+  objectNameNormalize(input, text + 1);
+  const size_t len = strlen(text);
+  text[len] = ' ';
+  text[len + 1] = '\0';
+
+  size_t count = 0;
+  size_t previous = 0, previous_len = 0;
+  size_t start = 1;
+  for (size_t i = 1; i <= len; i++) {
+    if (text[i] != ' ')
+      continue;
+
+    const size_t word_len = i - start;
+    if (word_len > 0) {
+      if (start == 1) {
+        addFeature(features, &count, hashFeature('f', text + start, word_len));
+      }
+      addFeature(features, &count, hashFeature('w', text + start, word_len));
+      if (previous_len > 0) {
+        addFeature(features, &count,
+                   hashFeature('b', text + previous, i - previous));
+      }
+      for (size_t j = start - 1; j + 3 <= i + 1; j++) {
+        addFeature(features, &count, hashFeature('c', text + j, 3));
+      }
+    }
+
+    previous = start;
+    previous_len = word_len;
+    start = i + 1;
+  }
+  return count;
+}
+
+intent_t *intentCreate(void) {
+  intent_t *intent = allocate(sizeof(intent_t));
+  if (!intent)
+    return NULL;
+
+  for (size_t i = 0; i < arrLen(corpus); i++) {
+    intentTrain(intent, corpus[i].text, corpus[i].action);
+  }
+  return intent;
+}
+
+// Sorts the features and drops the duplicates. Returns how many are left.
+static size_t featureSet(size_t *features, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    const size_t feature = features[i];
+    size_t j = i;
+    for (; j > 0 && features[j - 1] > feature; j--) {
+      features[j] = features[j - 1];
+    }
+    features[j] = feature;
+  }
+
+  size_t unique = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (unique == 0 || features[unique - 1] != features[i]) {
+      features[unique++] = features[i];
+    }
+  }
+  return unique;
+}
+
+static float cosine(const size_t *a, size_t a_len, const size_t *b,
+                    size_t b_len) {
+  if (a_len == 0 || b_len == 0) {
+    return 0;
+  }
+
+  size_t shared = 0;
+  for (size_t i = 0, j = 0; i < a_len && j < b_len;) {
+    if (a[i] == b[j]) {
+      shared++;
+      i++;
+      j++;
+    } else if (a[i] < b[j]) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  return (float)((double)shared / sqrt((double)a_len * (double)b_len));
+}
+
+void intentTrain(intent_t *self, const char *text, action_type_t action) {
+  panicif(action < 0 || action >= ACTION_TYPES, "invalid action");
+
+  size_t features[INTENT_MAX_FEATURES];
+  size_t count = extractFeatures(text, features);
+  for (size_t i = 0; i < count; i++) {
+    self->counts[action][features[i]]++;
+  }
+  self->totals[action] += (uint32_t)count;
+  self->examples[action]++;
+
+  if (self->shots_len < INTENT_SHOTS) {
+    intent_shot_t *shot = &self->shots[self->shots_len++];
+    shot->text = text;
+    shot->action = action;
+    count = featureSet(features, count);
+    shot->count = count < INTENT_SHOT_FEATURES ? count : INTENT_SHOT_FEATURES;
+    for (size_t i = 0; i < shot->count; i++) {
+      shot->features[i] = (uint16_t)features[i];
+    }
+  }
+}
+
+action_type_t intentClassify(const intent_t *self, const char *text,
+                             float *confidence) {
+  size_t features[INTENT_MAX_FEATURES];
+  const size_t count = extractFeatures(text, features);
+
+  uint32_t examples = 0;
+  for (size_t a = 0; a < ACTION_TYPES; a++) {
+    examples += self->examples[a];
+  }
+
+  // Log-likelihoods with add-one smoothing
+  double scores[ACTION_TYPES];
+  size_t best = 0;
+  for (size_t a = 0; a < ACTION_TYPES; a++) {
+    scores[a] = log((double)(self->examples[a] + 1) /
+                    (double)(examples + ACTION_TYPES));
+    const double total = (double)self->totals[a] + INTENT_FEATURES;
+    for (size_t i = 0; i < count; i++) {
+      scores[a] += log((double)(self->counts[a][features[i]] + 1) / total);
+    }
+    if (scores[a] > scores[best]) {
+      best = a;
+    }
+  }
+
+  double sum = 0;
+  for (size_t a = 0; a < ACTION_TYPES; a++) {
+    sum += exp(scores[a] - scores[best]);
+  }
+  *confidence = (float)(1.0 / sum);
+  return actions_types[best];
+}
+
+size_t intentNearest(const intent_t *self, const char *text, size_t k,
+                     size_t *indexes) {
+  size_t features[INTENT_MAX_FEATURES];
+  const size_t count = featureSet(features, extractFeatures(text, features));
+
+  float scores[INTENT_SHOTS];
+  for (size_t i = 0; i < self->shots_len; i++) {
+    size_t shot[INTENT_SHOT_FEATURES];
+    for (size_t j = 0; j < self->shots[i].count; j++) {
+      shot[j] = self->shots[i].features[j];
+    }
+    scores[i] = cosine(features, count, shot, self->shots[i].count);
+  }
+
+  // Repeatedly picks the best of the rest, then restores the learning order
+  k = k < self->shots_len ? k : self->shots_len;
+  bool picked[INTENT_SHOTS] = {};
+  for (size_t n = 0; n < k; n++) {
+    size_t best = 0;
+    while (picked[best]) {
+      best++;
+    }
+    for (size_t i = best + 1; i < self->shots_len; i++) {
+      if (!picked[i] && scores[i] > scores[best]) {
+        best = i;
+      }
+    }
+    picked[best] = true;
+  }
+
+  size_t stored = 0;
+  for (size_t i = 0; i < self->shots_len && stored < k; i++) {
+    if (picked[i]) {
+      indexes[stored++] = i;
+    }
+  }
+  return stored;
+}
+
+float intentSimilarity(const char *a, const char *b) {
+  size_t a_features[INTENT_MAX_FEATURES];
+  size_t b_features[INTENT_MAX_FEATURES];
+  const size_t a_len = featureSet(a_features, extractFeatures(a, a_features));
+  const size_t b_len = featureSet(b_features, extractFeatures(b, b_features));
+  return cosine(a_features, a_len, b_features, b_len);
+}
+
+void intentDestroy(intent_t **self) { deallocate(self); }
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "world/action.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Features are hashed into this many buckets, so that no vocabulary is kept
+#define INTENT_FEATURES 4096
+
+// Most examples kept to be retrieved, and most features kept for each of them
+#define INTENT_SHOTS 256
+#define INTENT_SHOT_FEATURES 64
+
+// Example learnt by the classifier, with the set of its features sorted
+typedef struct {
+  const char *text;
+  action_type_t action;
+  uint16_t features[INTENT_SHOT_FEATURES];
+  size_t count;
+} intent_shot_t;
+
+// Naive Bayes classifier telling the action meant by the player input. It
+// looks at words, pairs of words, and character trigrams: the latter make it
+// tolerant to typos and inflections. It is trained on a small corpus of
+// commands when created, and can learn more examples afterwards.
+typedef struct {
+  uint32_t counts[ACTION_TYPES][INTENT_FEATURES];
+  // Features seen per action
+  uint32_t totals[ACTION_TYPES];
+  // Examples seen per action
+  uint32_t examples[ACTION_TYPES];
+  // Examples seen, in order, to be shown to a model as shots
+  intent_shot_t shots[INTENT_SHOTS];
+  size_t shots_len;
+} intent_t;
+
+// Allocates a classifier trained on the built-in corpus
+intent_t *intentCreate(void);
+
+// Learns that the text means the action. The text is not copied: it is kept
+// as an example and must outlive the classifier.
+void intentTrain(intent_t *, const char *, action_type_t);
+
+// Returns the most likely action meant by the text. Confidence is set to its
+// probability among all actions.
+action_type_t intentClassify(const intent_t *, const char *, float *);
+
+// Stores the indexes of the k learnt examples most similar to the text, by
+// the cosine of their sets of features, in the order they were learnt.
+// Returns how many were stored.
+size_t intentNearest(const intent_t *, const char *, size_t, size_t *);
+
+// Cosine of the sets of features of the two texts
+float intentSimilarity(const char *, const char *);
+
+void intentDestroy(intent_t **);
@@ -0,0 +1,328 @@
+// archive (v0.0.1)
+// ---
+//
+// An append-only file of texts by 64 bit key, read through a memory map.
+// Records are checksummed and synced as they are appended: a record cut short
+// by a crash is dropped, with anything after it, when the archive is opened.
+// The offset of the last record of each key is indexed in memory, so texts
+// are found without scanning the file.
+//
+// ```c
+// archive_t* archive = archiveOpen("texts.archive", 1); // 1 is the format
+//
+// archiveAppend(archive, 42, "text"); // returns result
+//
+// const char *text;
+// archiveFind(archive, 42, &text); // returns ARCHIVE_RESULT_OK
+// archiveFind(archive, 7, &text); // returns ARCHIVE_ERROR_NOT_FOUND
+//
+// archiveClose(&archive);
+// ```
+// ___HEADER_END___
+
+#pragma once
+
+#include "alloc.h"
+#include "panic.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef uint64_t archive_key_t;
+
+typedef enum {
+  ARCHIVE_RESULT_OK = 0,
+  ARCHIVE_ERROR_NOT_FOUND,
+  ARCHIVE_ERROR_IO,
+} archive_result_t;
+
+static const char ARCHIVE_MAGIC[8] = {'A', 'R', 'C', 'H', 'I', 'V', 'E', 0};
+
+// Magic, then the format of the records chosen by the user
+#define ARCHIVE_HEADER_SIZE (sizeof(ARCHIVE_MAGIC) + sizeof(uint64_t))
+
+// Records are: key, length of the text, checksum, text and its terminator
+#define ARCHIVE_RECORD_HEADER_SIZE                                             \
+  (sizeof(archive_key_t) + sizeof(uint32_t) + sizeof(uint32_t))
+
+// Smallest mapping and index, grown by doubling
+#define ARCHIVE_MIN_MAPPED 65536
+#define ARCHIVE_MIN_SLOTS 64
+
+typedef struct {
+  int fd;
+  // Bytes of valid records, header included, and how many bytes are mapped.
+  // The mapping reaches past the end of the file, so appended records can be
+  // read without mapping the file again.
+  size_t size;
+  size_t mapped;
+  char *data;
+  // Offset of the last record of each key, with linear probing. Zero marks
+  // free slots, as no record starts where the header is.
+  archive_key_t *keys;
+  size_t *offsets;
+  size_t slots;
+  size_t indexed;
+} archive_t;
+
+static inline uint32_t archiveChecksum(archive_key_t key, const char *text,
+                                       size_t len) {
+  uint64_t hash = 14695981039346656037U;
+  const uint64_t prime = 1099511628211U;
+
+  for (size_t i = 0; i < sizeof(key); i++) {
+    hash ^= (key >> (i * 8)) & 0xFF;
+    hash *= prime;
+  }
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint64_t)(unsigned char)text[i];
+    hash *= prime;
+  }
+
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Maps the valid records, if they outgrew the mapping
+static inline archive_result_t archiveMap(archive_t *self) {
+  if (self->data && self->size <= self->mapped)
+    return ARCHIVE_RESULT_OK;
+
+  size_t mapped = self->mapped ? self->mapped : ARCHIVE_MIN_MAPPED;
+  while (mapped < self->size)
+    mapped *= 2;
+
+  if (self->data) {
+    munmap(self->data, self->mapped);
+    self->data = NULL;
+    self->mapped = 0;
+  }
+
+  void *data = mmap(NULL, mapped, PROT_READ, MAP_SHARED, self->fd, 0);
+  if (data == MAP_FAILED)
+    return ARCHIVE_ERROR_IO;
+
+  self->data = data;
+  self->mapped = mapped;
+  return ARCHIVE_RESULT_OK;
+}
+
+static inline size_t archiveSlot(const archive_t *self, archive_key_t key) {
+  size_t slot = (size_t)((key ^ (key >> 32)) * 11400714819323198485U) &
+                (self->slots - 1);
+  while (self->offsets[slot] && self->keys[slot] != key)
+    slot = (slot + 1) & (self->slots - 1);
+  return slot;
+}
+
+// Makes room in the index for one more key
+static inline archive_result_t archiveReserve(archive_t *self) {
+  if ((self->indexed + 1) * 2 <= self->slots)
+    return ARCHIVE_RESULT_OK;
+
+  const size_t slots = self->slots ? self->slots * 2 : ARCHIVE_MIN_SLOTS;
+  archive_key_t *keys = allocate(slots * sizeof(archive_key_t));
+  size_t *offsets = allocate(slots * sizeof(size_t));
+  if (!keys || !offsets) {
+    deallocate(&keys);
+    deallocate(&offsets);
+    return ARCHIVE_ERROR_IO;
+  }
+
+  archive_key_t *old_keys = self->keys;
+  size_t *old_offsets = self->offsets;
+  const size_t old_slots = self->slots;
+  self->keys = keys;
+  self->offsets = offsets;
+  self->slots = slots;
+  for (size_t i = 0; i < old_slots; i++) {
+    if (!old_offsets[i])
+      continue;
+    const size_t slot = archiveSlot(self, old_keys[i]);
+    self->keys[slot] = old_keys[i];
+    self->offsets[slot] = old_offsets[i];
+  }
+
+  deallocate(&old_keys);
+  deallocate(&old_offsets);
+  return ARCHIVE_RESULT_OK;
+}
+
+// Points the key to the record at the offset. Needs a reserved slot.
+static inline void archiveIndex(archive_t *self, archive_key_t key,
+                                size_t offset) {
+  const size_t slot = archiveSlot(self, key);
+  if (!self->offsets[slot])
+    self->indexed++;
+  self->keys[slot] = key;
+  self->offsets[slot] = offset;
+}
+
+// Reads the record at the offset, returning its size. Zero if it's invalid.
+static inline size_t archiveRecord(const archive_t *self, size_t offset,
+                                   archive_key_t *key, const char **text) {
+  if (offset + ARCHIVE_RECORD_HEADER_SIZE > self->size)
+    return 0;
+
+  const char *record = self->data + offset;
+  uint32_t len, checksum;
+  memcpy(key, record, sizeof(*key));
+  memcpy(&len, record + sizeof(*key), sizeof(len));
+  memcpy(&checksum, record + sizeof(*key) + sizeof(len), sizeof(checksum));
+
+  const size_t size = ARCHIVE_RECORD_HEADER_SIZE + len + 1;
+  if (offset + size > self->size)
+    return 0;
+
+  *text = record + ARCHIVE_RECORD_HEADER_SIZE;
+  if ((*text)[len] != 0 || archiveChecksum(*key, *text, len) != checksum)
+    return 0;
+
+  return size;
+}
+
+// Starts the file over with just the header
+static inline archive_result_t archiveReset(archive_t *self, uint64_t format) {
+  char header[ARCHIVE_HEADER_SIZE];
+  memcpy(header, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+  memcpy(header + sizeof(ARCHIVE_MAGIC), &format, sizeof(format));
+
+  if (ftruncate(self->fd, 0) != 0 ||
+      pwrite(self->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      fsync(self->fd) != 0) {
+    return ARCHIVE_ERROR_IO;
+  }
+
+  self->size = sizeof(header);
+  return ARCHIVE_RESULT_OK;
+}
+
+static inline void archiveClose(archive_t **self) {
+  if (!self || !*self)
+    return;
+
+  if ((*self)->data)
+    munmap((*self)->data, (*self)->mapped);
+  if ((*self)->fd >= 0)
+    close((*self)->fd);
+  deallocate(&(*self)->keys);
+  deallocate(&(*self)->offsets);
+  deallocate(self);
+}
+
+// Opens the archive at path, creating it if missing. Archives in another
+// format, or that are not archives at all, are emptied.
+static inline archive_t *archiveOpen(const char *path, uint64_t format) {
+  archive_t *self = allocate(sizeof(archive_t));
+  if (!self)
+    return NULL;
+
+  self->fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat file;
+  if (self->fd < 0 || fstat(self->fd, &file) != 0) {
+    archiveClose(&self);
+    return NULL;
+  }
+
+  self->size = (size_t)file.st_size;
+  if (archiveReserve(self) != ARCHIVE_RESULT_OK) {
+    archiveClose(&self);
+    return NULL;
+  }
+
+  if (self->size < ARCHIVE_HEADER_SIZE ||
+      archiveMap(self) != ARCHIVE_RESULT_OK ||
+      memcmp(self->data, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+      memcmp(self->data + sizeof(ARCHIVE_MAGIC), &format, sizeof(format)) !=
+          0) {
+    if (archiveReset(self, format) != ARCHIVE_RESULT_OK ||
+        archiveMap(self) != ARCHIVE_RESULT_OK) {
+      archiveClose(&self);
+      return NULL;
+    }
+    return self;
+  }
+
+  // Whatever follows the last valid record was being written during a crash
+  size_t offset = ARCHIVE_HEADER_SIZE;
+  archive_key_t key;
+  const char *text;
+  for (size_t size; (size = archiveRecord(self, offset, &key, &text));) {
+    if (archiveReserve(self) != ARCHIVE_RESULT_OK) {
+      archiveClose(&self);
+      return NULL;
+    }
+    archiveIndex(self, key, offset);
+    offset += size;
+  }
+
+  if (offset < self->size) {
+    if (ftruncate(self->fd, (off_t)offset) != 0) {
+      archiveClose(&self);
+      return NULL;
+    }
+    self->size = offset;
+  }
+
+  return self;
+}
+
+// Finds the text last appended with the key. It's only valid until the next
+// call to the archive.
+static inline archive_result_t archiveFind(archive_t *self, archive_key_t key,
+                                           const char **result) {
+  panicif(!self, "archive cannot be null");
+  const size_t offset = self->offsets[archiveSlot(self, key)];
+  if (!offset)
+    return ARCHIVE_ERROR_NOT_FOUND;
+
+  if (archiveMap(self) != ARCHIVE_RESULT_OK)
+    return ARCHIVE_ERROR_IO;
+
+  archive_key_t record_key;
+  if (!archiveRecord(self, offset, &record_key, result))
+    return ARCHIVE_ERROR_IO;
+
+  return ARCHIVE_RESULT_OK;
+}
+
+// Appends a record, and waits for it to be on disk. A failed append leaves
+// the archive as it was.
+__attribute__((warn_unused_result)) static inline archive_result_t
+archiveAppend(archive_t *self, archive_key_t key, const char *text) {
+  panicif(!self, "archive cannot be null");
+  const size_t len = strlen(text);
+  if (len > UINT32_MAX)
+    return ARCHIVE_ERROR_IO;
+
+  if (archiveReserve(self) != ARCHIVE_RESULT_OK)
+    return ARCHIVE_ERROR_IO;
+
+  const size_t size = ARCHIVE_RECORD_HEADER_SIZE + len + 1;
+  char *record = allocate(size);
+  if (!record)
+    return ARCHIVE_ERROR_IO;
+
+  const uint32_t record_len = (uint32_t)len;
+  const uint32_t checksum = archiveChecksum(key, text, len);
+  memcpy(record, &key, sizeof(key));
+  memcpy(record + sizeof(key), &record_len, sizeof(record_len));
+  memcpy(record + sizeof(key) + sizeof(record_len), &checksum,
+         sizeof(checksum));
+  memcpy(record + ARCHIVE_RECORD_HEADER_SIZE, text, len + 1);
+
+  const ssize_t written = pwrite(self->fd, record, size, (off_t)self->size);
+  deallocate(&record);
+
+  if (written != (ssize_t)size || fsync(self->fd) != 0) {
+    (void)ftruncate(self->fd, (off_t)self->size);
+    return ARCHIVE_ERROR_IO;
+  }
+
+  archiveIndex(self, key, self->size);
+  self->size += size;
+  return ARCHIVE_RESULT_OK;
+}
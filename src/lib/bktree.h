@@ -0,0 +1,207 @@
+// BK-tree (v0.0.1)
+// ---
+//
+// A tree of words with owned keys and non-owned values, searchable by edit
+// distance. Distance is the optimal string alignment variant of the
+// Damerau-Levenshtein distance: insertions, deletions, substitutions, and
+// transpositions of adjacent characters all count as one edit.
+// The same key can be inserted many times, with different values.
+//
+// ```c
+// bktree_t* tree = bktreeCreate();
+//
+// my_type_t value;
+// bktreeAdd(tree, "shears", &value);
+//
+// bktree_matches_t* matches = bktreeMatchesCreate(10);
+// bktreeSearch(tree, "shers", 1, matches); // finds "shears" at distance 1
+//
+// bktreeMatchesDestroy(&matches);
+// bktreeDestroy(&tree);
+// ```
+// ___HEADER_END___
+
+#pragma once
+
+#include "alloc.h"
+#include "buffers.h"
+#include "panic.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Longer keys are compared on their first BKTREE_KEY_LENGTH characters
+#define BKTREE_KEY_LENGTH 32
+
+typedef enum {
+  BKTREE_RESULT_OK = 0,
+  BKTREE_ERROR_ALLOCATION_FAILED,
+} bktree_result_t;
+
+typedef struct bktree_node_t bktree_node_t;
+struct bktree_node_t {
+  char *key;
+  void *value;
+  // Distance from the parent
+  size_t distance;
+  bktree_node_t *child;
+  bktree_node_t *sibling;
+};
+
+typedef struct {
+  bktree_node_t *root;
+} bktree_t;
+
+typedef struct {
+  const char *key;
+  void *value;
+  size_t distance;
+} bktree_match_t;
+
+typedef Buffer(bktree_match_t) bktree_matches_t;
+
+static inline size_t bktreeDistance(const char *a, const char *b) {
+  size_t a_len = strlen(a);
+  size_t b_len = strlen(b);
+  a_len = a_len < BKTREE_KEY_LENGTH ? a_len : BKTREE_KEY_LENGTH;
+  b_len = b_len < BKTREE_KEY_LENGTH ? b_len : BKTREE_KEY_LENGTH;
+
+  // Only three rows of the distance matrix are needed at once
+  size_t rows[3][BKTREE_KEY_LENGTH + 1];
+  size_t *before = rows[0];
+  size_t *previous = rows[1];
+  size_t *current = rows[2];
+
+  for (size_t j = 0; j <= b_len; j++) {
+    previous[j] = j;
+  }
+
+  for (size_t i = 1; i <= a_len; i++) {
+    current[0] = i;
+    for (size_t j = 1; j <= b_len; j++) {
+      const size_t cost = a[i - 1] == b[j - 1] ? 0 : 1;
+      size_t best = previous[j - 1] + cost;
+      if (previous[j] + 1 < best)
+        best = previous[j] + 1;
+      if (current[j - 1] + 1 < best)
+        best = current[j - 1] + 1;
+      if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] &&
+          before[j - 2] + 1 < best)
+        best = before[j - 2] + 1;
+      current[j] = best;
+    }
+
+    size_t *recycled = before;
+    before = previous;
+    previous = current;
+    current = recycled;
+  }
+
+  return previous[b_len];
+}
+
+static inline bktree_t *bktreeCreate(void) {
+  return allocate(sizeof(bktree_t));
+}
+
+__attribute__((warn_unused_result)) static inline bktree_result_t
+bktreeAdd(bktree_t *self, const char *key, void *value) {
+  panicif(!self, "tree cannot be null");
+  bktree_node_t *node = allocate(sizeof(bktree_node_t));
+  if (!node)
+    return BKTREE_ERROR_ALLOCATION_FAILED;
+
+  node->key = strdup(key);
+  if (!node->key) {
+    deallocate(&node);
+    return BKTREE_ERROR_ALLOCATION_FAILED;
+  }
+  node->value = value;
+
+  if (!self->root) {
+    self->root = node;
+    return BKTREE_RESULT_OK;
+  }
+
+  bktree_node_t *parent = self->root;
+  while (true) {
+    const size_t distance = bktreeDistance(parent->key, key);
+    bktree_node_t *child = parent->child;
+    while (child && child->distance != distance) {
+      child = child->sibling;
+    }
+
+    if (!child) {
+      node->distance = distance;
+      node->sibling = parent->child;
+      parent->child = node;
+      return BKTREE_RESULT_OK;
+    }
+    parent = child;
+  }
+}
+
+static inline void bktreeSearchNode(const bktree_node_t *node, const char *key,
+                                    size_t max_distance,
+                                    bktree_matches_t *matches) {
+  const size_t distance = bktreeDistance(node->key, key);
+  if (distance <= max_distance && matches->len < matches->cap) {
+    bktree_match_t match = {node->key, node->value, distance};
+    bufPush(matches, match);
+  }
+
+  // By triangle inequality, matches can only be under children at a distance
+  // from this node within max_distance of the key's
+  for (const bktree_node_t *child = node->child; child;
+       child = child->sibling) {
+    if (child->distance + max_distance >= distance &&
+        child->distance <= distance + max_distance) {
+      bktreeSearchNode(child, key, max_distance, matches);
+    }
+  }
+}
+
+// Appends the entries with keys within max_distance of the given key to the
+// matches, as long as there is room for them.
+static inline void bktreeSearch(const bktree_t *self, const char *key,
+                                size_t max_distance,
+                                bktree_matches_t *matches) {
+  panicif(!self, "tree cannot be null");
+  if (self->root) {
+    bktreeSearchNode(self->root, key, max_distance, matches);
+  }
+}
+
+static inline bktree_matches_t *bktreeMatchesCreate(size_t cap) {
+  bktree_matches_t *matches = NULL;
+  bufCreate(bktree_matches_t, bktree_match_t, matches, cap);
+  return matches;
+}
+
+static inline void bktreeMatchesDestroy(bktree_matches_t **self) {
+  deallocate(self);
+}
+
+static inline void bktreeNodeDestroy(bktree_node_t **self) {
+  if (!self || !*self)
+    return;
+
+  bktree_node_t *child = (*self)->child;
+  while (child) {
+    bktree_node_t *sibling = child->sibling;
+    bktreeNodeDestroy(&child);
+    child = sibling;
+  }
+
+  deallocate(&(*self)->key);
+  deallocate(self);
+}
+
+static inline void bktreeDestroy(bktree_t **self) {
+  if (!self || !*self)
+    return;
+
+  bktreeNodeDestroy(&(*self)->root);
+  deallocate(self);
+}
@@ -123,7 +123,7 @@ mapSet(map_t *self, const_map_key_t key, value_t value) {
 
   // When there is a collision with another key, look for the next free index
   if (collides_with_old_key) {
-    uint8_t i;
+    map_size_t i;
 
     for (i = 1; i < self->size; i++) {
       map_size_t probed_idx = (index + i) % self->size;
@@ -9,6 +9,8 @@
 #include "world/world.h"
 
 #include "configs/qwen.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
@@ -26,6 +28,35 @@ words_t *wordsCreate(size_t len) {
 
 void wordsDestroy(words_t **self) { deallocate(self); }
 
+static strings_t *candidatesCreate(size_t len, size_t cap) {
+  strings_t *candidates;
+  bufCreate(strings_t, string_t *, candidates, len);
+
+  for (size_t i = 0; i < len; i++) {
+    string_t *candidate = strCreate(cap);
+    if (!candidate) {
+      candidates->len = i;
+      return candidates;
+    }
+    bufPush(candidates, candidate);
+  }
+
+  return candidates;
+}
+
+static void candidatesDestroy(strings_t **self) {
+  if (!self || !(*self))
+    return;
+
+  size_t i = 0;
+  bufEach(*self, i) {
+    string_t *candidate = bufAt(*self, i);
+    strDestroy(&candidate);
+  }
+
+  deallocate(self);
+}
+
 static words_t STOP_WORDS =
     bufConst(4, "inventory", "player", "player's", "location");
 static words_t STOP_WORDS_CASE = bufConst(7, "EXITS", "EXIT", "ITEMS", "ACTION",
@@ -60,7 +91,83 @@ static void summarizeLocation(const location_t *location, string_t *summary) {
   strFmtAppend(summary, "\n");
 }
 
-master_t *masterCreate(world_t *world) {
+// Tokenizes the instructions opening a kind of prompt, with an optional user
+// message following them
+static tokens_t *instructionsCreate(const ai_t *ai, const string_t *system,
+                                    const char *shot) {
+  tokens_t *prompt = aiPromptCreate(ai);
+  if (!prompt) {
+    return NULL;
+  }
+
+  ai_result_t result = aiPromptAppend(ai, prompt, PROMPT_TYPE_SYS, system->data);
+  if (result == AI_RESULT_OK && shot) {
+    result = aiPromptAppend(ai, prompt, PROMPT_TYPE_USR, shot);
+  }
+
+  if (result != AI_RESULT_OK) {
+    aiPromptDestroy(&prompt);
+  }
+  return prompt;
+}
+
+static void promptStart(master_t *self, const tokens_t *instructions) {
+  self->prompt->len = 0;
+  (void)aiPromptAppendTokens(self->prompt, instructions);
+}
+
+// Appends a message to the prompt. A prompt exceeding the context is emptied,
+// which makes the generation fail rather than go on with missing parts.
+static void promptAppend(master_t *self, prompt_type_t type, const char *text) {
+  if (self->prompt->len == 0) {
+    return;
+  }
+
+  if (aiPromptAppend(self->ai, self->prompt, type, text) != AI_RESULT_OK) {
+    error("Prompt exceeds the context size");
+    self->prompt->len = 0;
+  }
+}
+
+// Turns of the narration kept in the session, and tokens left for a response
+static const size_t SESSION_TURNS = 8;
+static const size_t SESSION_RESPONSE_TOKENS = 256;
+
+static turns_t *turnsCreate(size_t cap) {
+  turns_t *turns = NULL;
+  bufCreate(turns_t, size_t, turns, cap);
+  return turns;
+}
+
+static void turnsDestroy(turns_t **self) { deallocate(self); }
+
+// Forgets the oldest turns of the session, until there is room for a new turn
+// and for the response to the latest one. The latest turn is never forgotten.
+static void sessionFit(master_t *self, size_t latest) {
+  const size_t pinned = self->action_prompt->len;
+  const size_t context_size = self->ai->configuration->context_size;
+  tokens_t *session = self->session;
+  turns_t *turns = self->turns;
+
+  while (turns->len > 0 &&
+         (turns->len == turns->cap ||
+          pinned + session->len + SESSION_RESPONSE_TOKENS > context_size)) {
+    const size_t oldest = bufAt(turns, 0);
+    panicif(oldest + latest > session->len, "session out of sync");
+
+    // The KV cache shifts too: what follows is not decoded again
+    aiForget(self->ai, pinned, pinned + oldest);
+    memmove(session->data, session->data + oldest,
+            sizeof(llama_token) * (session->len - oldest));
+    session->len -= oldest;
+    memmove(turns->data, turns->data + 1, sizeof(size_t) * (turns->len - 1));
+    turns->len--;
+  }
+}
+
+// Prefetchers narrate on the model of their master, and give it back when
+// asked to yield. Masters without a model to borrow create their own.
+static master_t *masterCreateOn(world_t *world, ai_t *ai, atomic_bool *yield) {
   panicif(!world || !world->items || !world->locations,
           "need to initialize world first");
   master_t *master = allocate(sizeof(master_t));
@@ -69,20 +176,62 @@ master_t *masterCreate(world_t *world) {
     return NULL;
   }
 
-  ai_result_t result;
-  master->ai = aiCreate(&NARRATOR_CONFIG, &result);
-  if (result != AI_RESULT_OK) {
-    error("cannot allocate AI for master");
+  master->yield = yield;
+  master->ai = ai;
+  if (!master->ai) {
+    ai_result_t result;
+    master->ai = aiCreate(&NARRATOR_CONFIG, &result);
+    if (result != AI_RESULT_OK) {
+      error("cannot allocate AI for master");
+      masterDestroy(&master);
+      return NULL;
+    }
+  }
+
+  master->prompt = aiPromptCreate(master->ai);
+  master->location_prompt =
+      instructionsCreate(master->ai, &MASTER_WORLD_DESC_SYS_PROMPT, NULL);
+  master->object_prompt =
+      instructionsCreate(master->ai, &MASTER_OBJECT_DESC_SYS_PROMPT, NULL);
+  if (!master->prompt || !master->location_prompt || !master->object_prompt) {
+    error("cannot allocate prompt buffer");
+    masterDestroy(&master);
     return NULL;
   }
 
-  master->prompt = strCreate(4096);
-  if (!master->prompt) {
+  const size_t candidates = master->ai->configuration->candidates;
+  master->candidates = candidatesCreate(candidates ? candidates : 1, 4096);
+  if (!master->candidates || bufIsEmpty(master->candidates)) {
+    error("cannot allocate candidates buffer");
+    masterDestroy(&master);
+    return NULL;
+  }
+
+  // Prefetchers only narrate locations and objects, into the memory of their
+  // master: they need nothing else
+  if (yield) {
+    return master;
+  }
+
+  master->action_prompt =
+      instructionsCreate(master->ai, &MASTER_ACTION_SYS_PROMPT, NULL);
+  // Using a shot to provide some context
+  master->end_game_prompt = instructionsCreate(
+      master->ai, &MASTER_END_GAME_SYS_PROMPT, "look around");
+  if (!master->action_prompt || !master->end_game_prompt) {
     error("cannot allocate prompt buffer");
     masterDestroy(&master);
     return NULL;
   }
 
+  master->session = aiPromptCreate(master->ai);
+  master->turns = turnsCreate(SESSION_TURNS);
+  if (!master->session || !master->turns) {
+    error("cannot allocate session buffer");
+    masterDestroy(&master);
+    return NULL;
+  }
+
   master->summary = strCreate(4096);
   if (!master->summary) {
     error("cannot allocate summary buffer");
@@ -90,7 +239,9 @@ master_t *masterCreate(world_t *world) {
     return NULL;
   }
 
-  master->descriptions = mapCreate(world->items->len + world->locations->len);
+  // Each object is remembered in two namespaces at most
+  master->descriptions =
+      mapCreate(2 * (world->items->len + world->locations->len));
   if (!master->descriptions) {
     error("cannot allocate summary buffer");
     masterDestroy(&master);
@@ -100,46 +251,330 @@ master_t *masterCreate(world_t *world) {
   return master;
 }
 
-static char cache_key_buffer[256] = {};
-static map_key_t makeCacheKey(object_name_t name, const char *namespace) {
-  snprintf(cache_key_buffer, 256, "%s.%s", namespace, name);
-  return cache_key_buffer;
+master_t *masterCreate(world_t *world) {
+  return masterCreateOn(world, NULL, NULL);
 }
 
-static const char *WORD_BREAK = " \t\r\n:-*'.,";
+// Keys are written to a buffer of the caller: the prefetcher makes them too
+static map_key_t makeCacheKey(char *key, object_name_t name,
+                              const char *namespace) {
+  snprintf(key, MASTER_CACHE_KEY_LENGTH, "%s.%s", namespace, name);
+  return key;
+}
 
-static int hasStopWords(string_t *response) {
-  panicif(!response, "missing response");
+// Once the prefetcher is started, the memory is shared with its thread
+static void memoryLock(master_t *self) {
+  if (self->prefetch)
+    pthread_mutex_lock(&self->prefetch->lock);
+}
+
+static void memoryUnlock(master_t *self) {
+  if (self->prefetch)
+    pthread_mutex_unlock(&self->prefetch->lock);
+}
+
+static archive_key_t hashText(archive_key_t hash, const char *text) {
+  const uint64_t prime = 1099511628211U;
+  for (const char *c = text; *c; c++) {
+    hash ^= (uint64_t)(unsigned char)*c;
+    hash *= prime;
+  }
+  // Separates consecutive texts
+  hash ^= 0xFF;
+  return hash * prime;
+}
+
+static archive_key_t hashNumber(archive_key_t hash, uint64_t number) {
+  char text[32];
+  snprintf(text, sizeof(text), "%llu", (unsigned long long)number);
+  return hashText(hash, text);
+}
+
+static archive_key_t hashObject(archive_key_t hash, const object_t *object) {
+  hash = hashText(hash, object->name);
+  size_t i = 0;
+  bufEach(object->descriptions, i) {
+    hash = hashText(hash, bufAt(object->descriptions, i));
+  }
+  return hash;
+}
+
+// Archived descriptions hold for the same story, model, and prompts
+static archive_key_t archiveSeed(const world_t *world) {
+  archive_key_t hash = 14695981039346656037U;
+  hash = hashNumber(hash, MASTER_ARCHIVE_FORMAT);
+  hash = hashText(hash, NARRATOR_CONFIG.path);
+  hash = hashText(hash, MASTER_WORLD_DESC_SYS_PROMPT.data);
+  hash = hashText(hash, MASTER_OBJECT_DESC_SYS_PROMPT.data);
+
+  size_t i = 0;
+  bufEach(world->items, i) {
+    hash = hashObject(hash, &bufAt(world->items, i)->object);
+  }
+
+  bufEach(world->locations, i) {
+    const location_t *location = bufAt(world->locations, i);
+    hash = hashObject(hash, &location->object);
+    for (size_t j = 0; j < location->exits->len; j++) {
+      hash = hashText(hash, location->exits->data[j]->object.name);
+    }
+  }
+  return hash;
+}
+
+// Keys the description of an object in its current state. Descriptions of
+// locations depend on the items in them as well, in whatever order.
+static archive_key_t archiveKey(const master_t *self, const char *namespace,
+                                const object_t *object,
+                                const location_t *location) {
+  archive_key_t hash = hashText(self->archive_seed, namespace);
+  hash = hashText(hash, object->name);
+  hash = hashNumber(hash, object->state);
+
+  if (location) {
+    archive_key_t items = 0;
+    size_t i = 0;
+    bufEach(location->items, i) {
+      items += hashText(0, bufAt(location->items, i)->object.name);
+    }
+    hash = hashNumber(hash, items);
+  }
+  return hash;
+}
+
+static memory_source_t memorySource(const object_t *object) {
+  return (memory_source_t){
+      .object = object, .state = object->state, .version = object->version};
+}
+
+static void memoryDestroy(master_t *self, memory_t **memory) {
+  if (!memory || !*memory)
+    return;
+
+  self->memory_bytes -= strlen((*memory)->text) + 1;
+  deallocate(&(*memory)->text);
+  deallocate(memory);
+}
+
+// The functions below require the lock, when the prefetcher is started
+
+static void memoryForget(master_t *self, map_key_t key) {
+  memory_t *memory = mapDelete(self->descriptions, key);
+  memoryDestroy(self, &memory);
+}
+
+// Forgets the least recently used description
+static int memoryEvict(master_t *self) {
+  map_t *descriptions = self->descriptions;
+  map_size_t oldest = descriptions->size;
+  for (map_size_t i = 0; i < descriptions->size; i++) {
+    const memory_t *memory = descriptions->values[i];
+    if (memory && (oldest == descriptions->size ||
+                   memory->used < ((memory_t *)descriptions->values[oldest])
+                                      ->used)) {
+      oldest = i;
+    }
+  }
 
-  string_t *input cleanup(strDestroy) = strDup(response);
-  if (!input)
+  if (oldest == descriptions->size)
     return 0;
 
-  char *saveptr = NULL;
-  char *token = strtok_r(input->data, WORD_BREAK, &saveptr);
-  while (token) {
-    for (size_t i = 0; i < STOP_WORDS.len; i++) {
-      const char *word = bufAt(&STOP_WORDS, i);
-      if (strcasecmp(token, word) == 0) {
-        info("Invalid: Found a STOP WORD %s", word);
-        return 1;
-      }
+  debug("evicting from cache: %s\n", descriptions->keys[oldest]);
+  memoryForget(self, descriptions->keys[oldest]);
+  return 1;
+}
+
+// Whether the object changed since the description was made
+static bool memoryStale(const memory_source_t *source) {
+  return source->object->state != source->state ||
+         source->object->version != source->version;
+}
+
+// Looks a description up, forgetting it if its object changed since. The
+// world is read: only call it from the thread running the game.
+static const memory_t *memoryGet(master_t *self, map_key_t key) {
+  memory_t *memory = mapGet(self->descriptions, key);
+  if (!memory)
+    return NULL;
+
+  if (memoryStale(&memory->source)) {
+    debug("stale in cache: %s\n", key);
+    memoryForget(self, key);
+    return NULL;
+  }
+
+  memory->used = ++self->memory_clock;
+  return memory;
+}
+
+static void store(master_t *self, map_key_t key, const char *description,
+                  memory_source_t source) {
+  memoryForget(self, key);
+
+  const size_t size = strlen(description) + 1;
+  while (self->memory_bytes + size > MASTER_MEMORY_BYTES &&
+         memoryEvict(self)) {
+  }
+
+  memory_t *memory = allocate(sizeof(memory_t));
+  char *text = strdup(description);
+  if (!memory || !text) {
+    error("cannot allocate memory for %s", key);
+    deallocate(&memory);
+    deallocate(&text);
+    return;
+  }
+  *memory = (memory_t){
+      .text = text, .source = source, .used = ++self->memory_clock};
+  self->memory_bytes += size;
+
+  while (mapSet(self->descriptions, key, memory) == MAP_ERROR_FULL) {
+    if (!memoryEvict(self)) {
+      error("cannot remember %s", key);
+      memoryDestroy(self, &memory);
+      return;
     }
+  }
+  debug("written cache at: %s\n", key);
+}
+
+// Finds a description of a previous session, and remembers it
+static int unarchive(master_t *self, map_key_t key, archive_key_t archive_key,
+                     memory_source_t source) {
+  const char *text = NULL;
+  if (!self->archive ||
+      archiveFind(self->archive, archive_key, &text) != ARCHIVE_RESULT_OK) {
+    return 0;
+  }
+
+  debug("returning from archive: %s\n", key);
+  store(self, key, text, source);
+  return 1;
+}
+
+static void persist(master_t *self, archive_key_t archive_key,
+                    const char *description) {
+  if (self->archive &&
+      archiveAppend(self->archive, archive_key, description) !=
+          ARCHIVE_RESULT_OK) {
+    error("cannot archive description");
+  }
+}
+
+static int recallArchived(master_t *self, map_key_t key,
+                          archive_key_t archive_key, const object_t *object,
+                          string_t *description) {
+  memoryLock(self);
+  const memory_t *memory =
+      unarchive(self, key, archive_key, memorySource(object))
+          ? mapGet(self->descriptions, key)
+          : NULL;
+  if (memory) {
+    strFmt(description, "%s", memory->text);
+  }
+  memoryUnlock(self);
+  return memory != NULL;
+}
+
+static void rememberArchived(master_t *self, map_key_t key,
+                             archive_key_t archive_key,
+                             const char *description, const object_t *object) {
+  memoryLock(self);
+  store(self, key, description, memorySource(object));
+  persist(self, archive_key, description);
+  memoryUnlock(self);
+}
+
+static int recall(master_t *self, map_key_t key, string_t *description) {
+  memoryLock(self);
+  const memory_t *memory = memoryGet(self, key);
+  if (memory) {
+    strFmt(description, "%s", memory->text);
+  }
+  memoryUnlock(self);
+  return memory != NULL;
+}
+
+static void remember(master_t *self, map_key_t key, const char *description,
+                     const object_t *object) {
+  memoryLock(self);
+  store(self, key, description, memorySource(object));
+  memoryUnlock(self);
+}
+
+static bool yielded(const master_t *self) {
+  return self->yield && atomic_load(self->yield);
+}
+
+static const char *WORD_BREAK = " \t\r\n:-*'.,";
 
-    for (size_t i = 0; i < STOP_WORDS_CASE.len; i++) {
-      const char *word = bufAt(&STOP_WORDS_CASE, i);
-      if (strcmp(token, word) == 0) {
-        info("Invalid: Found a STOP WORD %s", word);
-        return 1;
-      }
+static const char STOP_CHARS[] = {'[', '*', '('};
+
+static int isStopWord(const char *token, size_t len) {
+  for (size_t i = 0; i < STOP_WORDS.len; i++) {
+    const char *word = bufAt(&STOP_WORDS, i);
+    if (strlen(word) == len && strncasecmp(token, word, len) == 0) {
+      info("Invalid: Found a STOP WORD %s", word);
+      return 1;
+    }
+  }
+
+  for (size_t i = 0; i < STOP_WORDS_CASE.len; i++) {
+    const char *word = bufAt(&STOP_WORDS_CASE, i);
+    if (strlen(word) == len && strncmp(token, word, len) == 0) {
+      info("Invalid: Found a STOP WORD %s", word);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int isStopChar(char c) {
+  for (size_t i = 0; i < arrLen(STOP_CHARS); i++) {
+    if (c == STOP_CHARS[i]) {
+      info("Invalid: Found a STOP CHAR %c", c);
+      return 1;
     }
+  }
+  return 0;
+}
+
+// Checks the response for stop words and stop chars starting from the offset,
+// which is then moved past the last complete word. This allows to validate a
+// response incrementally while it is generated. The last word is checked only
+// when the response is complete: more characters could still be appended.
+static int hasStopWordsFrom(const string_t *response, size_t *offset,
+                            bool complete) {
+  size_t start = *offset;
+  for (size_t i = *offset; i < response->len; i++) {
+    const char c = bufAt(response, i);
+    if (isStopChar(c))
+      return 1;
+
+    if (!strchr(WORD_BREAK, c))
+      continue;
 
-    token = strtok_r(NULL, WORD_BREAK, &saveptr);
+    if (i > start && isStopWord(response->data + start, i - start))
+      return 1;
+    start = i + 1;
+  }
+
+  if (complete && response->len > start &&
+      isStopWord(response->data + start, response->len - start)) {
+    return 1;
   }
 
+  *offset = complete ? response->len : start;
   return 0;
 }
 
+static int hasStopWords(string_t *response) {
+  panicif(!response, "missing response");
+  size_t offset = 0;
+  return hasStopWordsFrom(response, &offset, true);
+}
+
 static int hasAllMustHaves(string_t *response, words_t *must_haves) {
   panicif(!response, "missing response");
   if (!must_haves)
@@ -168,9 +603,112 @@ int masterIsValidResponse(string_t *response, words_t *must_haves) {
   return !hasStopWords(response) && hasAllMustHaves(response, must_haves);
 }
 
-static void generateAndValidate(ai_t *ai, const string_t *prompt,
-                                string_t *response, words_t *must_haves) {
-  debug("Prompt:\n%s", prompt->data);
+void masterSetStream(master_t *self, master_stream_callback_t callback,
+                     void *data) {
+  self->stream = callback;
+  self->stream_data = data;
+}
+
+// Tracks the candidates generated for a single description
+typedef struct {
+  master_t *master;
+  words_t *must_haves;
+  // Whether validated text is forwarded to the stream callback
+  bool stream;
+  // Candidate being streamed. Meaningful only when streamed is not zero
+  size_t candidate;
+  // Length of the response already forwarded to the stream callback
+  size_t streamed;
+  // Per candidate, how much of the response was checked for stop words
+  size_t *checked;
+} generation_t;
+
+static void streamUntil(generation_t *generation, string_t *response,
+                        size_t end) {
+  if (!generation->stream || end <= generation->streamed)
+    return;
+
+  master_t *master = generation->master;
+  master->stream(response->data + generation->streamed,
+                 end - generation->streamed, master->stream_data);
+  generation->streamed = end;
+}
+
+// Streams the complete sentences of the response as soon as they make for a
+// valid description on their own: the rest of the response cannot invalidate
+// them anymore, since the response can be cut short after them.
+// Sentences are made of complete words, already checked for stop words.
+static void streamSentences(generation_t *generation, size_t candidate,
+                            string_t *response) {
+  size_t end = 0;
+  for (size_t i = generation->streamed; i + 1 < response->len; i++) {
+    if (strchr(".!?", response->data[i]) && isspace(response->data[i + 1])) {
+      end = i + 1;
+    }
+  }
+
+  if (end <= generation->streamed)
+    return;
+
+  const size_t len = response->len;
+  const char next = response->data[end];
+  response->data[end] = 0;
+  response->len = end;
+  const int valid = hasAllMustHaves(response, generation->must_haves);
+  response->data[end] = next;
+  response->len = len;
+
+  if (valid) {
+    generation->candidate = candidate;
+    streamUntil(generation, response, end);
+  }
+}
+
+static ai_verdict_t followCandidate(size_t candidate, string_t *response,
+                                    ai_step_t step, void *data) {
+  generation_t *generation = data;
+  if (yielded(generation->master))
+    return AI_VERDICT_REJECT;
+
+  const bool is_streamed =
+      generation->streamed > 0 && generation->candidate == candidate;
+
+  // Once text has been shown, the other candidates cannot be used anymore
+  if (generation->streamed > 0 && !is_streamed)
+    return AI_VERDICT_REJECT;
+
+  // Stop words are looked for while generating, to give up early on invalid
+  // responses. Checking the must-haves needs the complete response instead.
+  size_t *checked = &generation->checked[candidate];
+  const bool complete = step == AI_STEP_END;
+  const int valid = !hasStopWordsFrom(response, checked, complete);
+
+  if (valid && step == AI_STEP_TOKEN) {
+    streamSentences(generation, candidate, response);
+    return AI_VERDICT_CONTINUE;
+  }
+
+  if (valid && complete &&
+      hasAllMustHaves(response, generation->must_haves)) {
+    streamUntil(generation, response, response->len);
+    return AI_VERDICT_ACCEPT;
+  }
+
+  // The streamed sentences are valid, and already on screen
+  if (is_streamed) {
+    response->len = generation->streamed;
+    response->data[response->len] = 0;
+    return AI_VERDICT_ACCEPT;
+  }
+
+  debug("Rejected:\n%s\n", response->data);
+  return AI_VERDICT_REJECT;
+}
+
+static int generateAndValidate(master_t *self, tokens_t *prompt,
+                                string_t *response, words_t *must_haves,
+                                bool stream) {
+  debug("Prompt: %zu tokens", prompt->len);
   int valid = 0;
   ai_result_t result;
 #ifdef DISABLE_VALIDATION
@@ -178,129 +716,270 @@ static void generateAndValidate(ai_t *ai, const string_t *prompt,
 #else
   static const size_t MAX_ATTEMPTS = 20;
 #endif
-  for (size_t i = 0; i < MAX_ATTEMPTS && !valid; i++) {
-    strClear(response);
-    result = aiReset(ai);
+  // Every round generates as many attempts as there are candidates
+  const size_t candidates = self->candidates->len;
+  const size_t rounds = (MAX_ATTEMPTS + candidates - 1) / candidates;
+
+  generation_t generation = {
+      .master = self,
+      .must_haves = must_haves,
+      .stream = stream && self->stream,
+      .checked = allocate(sizeof(size_t) * candidates),
+  };
+  panicif(!generation.checked, "cannot allocate validation state");
+
+  for (size_t i = 0; i < rounds && !valid && !yielded(self); i++) {
+    result = aiReset(self->ai);
     panicif(result != AI_RESULT_OK, "cannot reset model state");
-    result = aiGenerate(ai, prompt, response);
-    if (result != AI_RESULT_OK) {
-      valid = 0;
-      continue;
+    memset(generation.checked, 0, sizeof(size_t) * candidates);
+    // A generation failing early must not leave a previous response behind
+    for (size_t j = 0; j < candidates; j++) {
+      strClear(bufAt(self->candidates, j));
     }
-    valid = masterIsValidResponse(response, must_haves);
 
-    if (!valid)
-      debug("Rejected:\n%s\n", response->data);
+    size_t accepted = 0;
+    result = aiGenerateCandidates(self->ai, prompt, self->candidates,
+                                  followCandidate, &generation, &accepted);
+    valid = result == AI_RESULT_OK;
+
+    // Retrying would splice another response to the text on screen. That text
+    // is valid already: the description ends with it.
+    string_t *streamed = bufAt(self->candidates, generation.candidate);
+    if (!valid && generation.streamed > 0 &&
+        generation.streamed <= streamed->len) {
+      streamed->len = generation.streamed;
+      streamed->data[streamed->len] = 0;
+      accepted = generation.candidate;
+      valid = 1;
+    }
+    strFmt(response, "%s", bufAt(self->candidates, accepted)->data);
   }
-  if (!valid) {
+  deallocate(&generation.checked);
+
+#if LOG_LEVEL >= LOG_DEBUG
+  const ai_stats_t *stats = &self->ai->stats;
+  debug("Drafts accepted: %zu/%zu, tokens per step: %.2f", stats->accepted,
+        stats->drafted,
+        stats->steps ? (double)stats->generated / (double)stats->steps : 0.0);
+#endif
+
+  if (!valid && !yielded(self)) {
     error("Invalid output: giving up.")
   }
+  return valid;
 }
 
-void masterDescribeLocation(master_t *self, const location_t *location,
-                            string_t *description) {
-  map_key_t cache_key = makeCacheKey(location->object.name, LOCATION_NAMESPACE);
-  char *cached = mapGet(self->descriptions, cache_key);
-  if (cached) {
+// Every item and exit has to be mentioned in the description of a location
+static void locationMustHaves(const location_t *location, words_t *must_haves) {
+  must_haves->len = 0;
+  size_t i = 0;
+  bufEach(location->items, i) {
+    item_t *item = bufAt(location->items, i);
+    bufPush(must_haves, item->object.name);
+  }
+
+  bufEach(location->exits, i) {
+    location_t *exit = (location_t *)bufAt(location->exits, i);
+    bufPush(must_haves, exit->object.name);
+  }
+}
+
+static int narrateLocation(master_t *self, const string_t *summary,
+                           words_t *must_haves, string_t *description,
+                           bool stream) {
+  debug("Summary:\n%s", summary->data);
+  promptStart(self, self->location_prompt);
+  promptAppend(self, PROMPT_TYPE_USR, summary->data);
+  promptAppend(self, PROMPT_TYPE_RES, "");
+
+  return generateAndValidate(self, self->prompt, description, must_haves,
+                             stream);
+}
+
+// Lists items and exits after the authored description, like its summary does.
+// Only for the player to read: the model is never shown them as narration.
+static void appendSections(const location_t *location, string_t *description) {
+  size_t i = 0;
+  if (!bufIsEmpty(location->items)) {
+    strFmtAppend(description, "\n\nItems: ");
+    bufEach(location->items, i) {
+      item_t *item = bufAt(location->items, i);
+      strFmtAppend(description, "%s%s", i > 0 ? ", " : "", item->object.name);
+    }
+  }
+
+  strFmtAppend(description, "\n\nExits: ");
+  bufEach(location->exits, i) {
+    location_t *exit = (location_t *)bufAt(location->exits, i);
+    strFmtAppend(description, "%s%s", i > 0 ? ", " : "", exit->object.name);
+  }
+}
+
+static void prefetchRevalidate(master_t *self, const location_t *location,
+                               const object_t *object);
+
+// Returns whether the description is the one authored in the story, as it is
+// still to be narrated
+static bool describeLocation(master_t *self, const location_t *location,
+                             string_t *description, bool stream) {
+  char cache_key[MASTER_CACHE_KEY_LENGTH];
+  makeCacheKey(cache_key, location->object.name, LOCATION_NAMESPACE);
+  if (recall(self, cache_key, description)) {
     debug("returning from cache: %s\n", cache_key);
-    strFmt(description, "%s", cached);
-    return;
+    return false;
   }
   debug("cache miss: %s\n", cache_key);
 
-  const config_t *config = self->ai->configuration;
-  const string_t *usr_prompt_tpl = config->prompt_templates[PROMPT_TYPE_USR];
-  const string_t *sys_prompt_tpl = config->prompt_templates[PROMPT_TYPE_SYS];
-  const string_t *res_prompt_tpl = config->prompt_templates[PROMPT_TYPE_RES];
-
-  strFmt(self->prompt, sys_prompt_tpl->data, MASTER_WORLD_DESC_SYS_PROMPT.data);
+  const archive_key_t archive_key =
+      archiveKey(self, LOCATION_NAMESPACE, &location->object, location);
+  if (recallArchived(self, cache_key, archive_key, &location->object,
+                     description)) {
+    return false;
+  }
 
-  summarizeLocation(location, self->summary);
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, self->summary->data);
-  strFmtAppend(self->prompt, res_prompt_tpl->data, "");
+  if (self->progressive) {
+    strFmt(description, "%s",
+           bufAt(location->object.descriptions, location->object.state));
+    prefetchRevalidate(self, location, NULL);
+    return true;
+  }
 
   // TODO: this seems inefficient: this list can never be longer than all
   // elements + all exits, it could be statically allocated
   words_t *must_haves cleanup(wordsDestroy) =
       wordsCreate(location->items->len + location->exits->len);
+  locationMustHaves(location, must_haves);
 
-  size_t i = 0;
-  bufEach(location->items, i) {
-    item_t *item = bufAt(location->items, i);
-    bufPush(must_haves, item->object.name);
+  summarizeLocation(location, self->summary);
+  // Invalid descriptions are shown, but generated again next time
+  if (narrateLocation(self, self->summary, must_haves, description, stream)) {
+    rememberArchived(self, cache_key, archive_key, description->data,
+                     &location->object);
   }
+  return false;
+}
 
-  bufEach(location->exits, i) {
-    location_t *exit = (location_t *)bufAt(location->exits, i);
-    bufPush(must_haves, exit->object.name);
+// Takes the model back from the prefetcher, dropping what is queued, and
+// waits for it to leave the model
+static void prefetchYield(master_t *self) {
+  prefetch_t *prefetch = self->prefetch;
+  if (!prefetch)
+    return;
+
+  pthread_mutex_lock(&prefetch->lock);
+  prefetch->next = prefetch->queued = 0;
+  atomic_store(&prefetch->yield, true);
+  // The world is only read here, on the thread running the game
+  if (prefetch->busy && memoryStale(&prefetch->current))
+    prefetch->epoch++;
+  while (prefetch->busy) {
+    pthread_cond_wait(&prefetch->signal, &prefetch->lock);
   }
+  pthread_mutex_unlock(&prefetch->lock);
+}
 
-  generateAndValidate(self->ai, self->prompt, description, must_haves);
+// Gives the model back to the prefetcher, for the descriptions queued since
+static void prefetchResume(master_t *self) {
+  prefetch_t *prefetch = self->prefetch;
+  if (!prefetch)
+    return;
+
+  pthread_mutex_lock(&prefetch->lock);
+  atomic_store(&prefetch->yield, false);
+  pthread_cond_broadcast(&prefetch->signal);
+  pthread_mutex_unlock(&prefetch->lock);
+}
 
-  char *description_data = strdup(description->data);
-  char *description_key = strdup(cache_key);
-  (void)mapSet(self->descriptions, description_key, description_data);
-  debug("written cache at: %s\n", cache_key);
+void masterDescribeLocation(master_t *self, const location_t *location,
+                            string_t *description) {
+  prefetchYield(self);
+  if (describeLocation(self, location, description, true)) {
+    appendSections(location, description);
+  }
+  prefetchResume(self);
 }
 
 void masterReadItem(master_t *self, const item_t *item, string_t *description) {
+  prefetchYield(self);
   const object_t object = item->object;
-  map_key_t cache_key = makeCacheKey(object.name, ITEM_NAMESPACE);
+  char cache_key[MASTER_CACHE_KEY_LENGTH];
+  makeCacheKey(cache_key, object.name, ITEM_NAMESPACE);
   debug("reading cache key: %s\n", cache_key);
   const char *state_desc = bufAt(object.descriptions, object.state);
   strFmt(description, "%s", state_desc);
-  char *copy = strdup(description->data);
-  (void)mapSet(self->descriptions, cache_key, copy);
-  debug("written cache at: %s\n", cache_key);
+  remember(self, cache_key, description->data, &item->object);
+  prefetchResume(self);
 }
 
-void masterDescribeObject(master_t *self, const object_t *object,
-                          string_t *description) {
-  map_key_t cache_key = makeCacheKey(object->name, OBJECT_NAMESPACE);
+static void summarizeObject(const object_t *object, string_t *summary) {
+  strFmt(summary, "\nITEM:\n name: %s\n description: %s\n", object->name,
+         bufAt(object->descriptions, object->state));
+}
+
+static int narrateObject(master_t *self, const string_t *summary,
+                         string_t *description, bool stream) {
+  promptStart(self, self->object_prompt);
+  if (aiPromptAppendText(self->ai, self->prompt, summary->data) !=
+      AI_RESULT_OK) {
+    self->prompt->len = 0;
+  }
+  promptAppend(self, PROMPT_TYPE_RES, "");
+
+  return generateAndValidate(self, self->prompt, description, NULL, stream);
+}
 
-  char *cached = mapGet(self->descriptions, cache_key);
-  if (cached) {
+static void describeObject(master_t *self, const object_t *object,
+                           string_t *description) {
+  char cache_key[MASTER_CACHE_KEY_LENGTH];
+  makeCacheKey(cache_key, object->name, OBJECT_NAMESPACE);
+  if (recall(self, cache_key, description)) {
     debug("returning from cache: %s\n", cache_key);
-    strFmt(description, "%s", cached);
     return;
   }
   debug("cache miss: %s\n", cache_key);
 
-  const config_t *config = self->ai->configuration;
-  const string_t *sys_prompt_tpl = config->prompt_templates[PROMPT_TYPE_SYS];
-  const string_t *res_prompt_tpl = config->prompt_templates[PROMPT_TYPE_RES];
-
-  strFmt(self->prompt, sys_prompt_tpl->data,
-         MASTER_OBJECT_DESC_SYS_PROMPT.data);
-
-  strFmtAppend(self->prompt, "\nITEM:\n name: %s\n description: %s\n",
-               object->name, bufAt(object->descriptions, object->state));
-
-  strFmtAppend(self->prompt, res_prompt_tpl->data, "");
+  const archive_key_t archive_key =
+      archiveKey(self, OBJECT_NAMESPACE, object, NULL);
+  if (recallArchived(self, cache_key, archive_key, object, description)) {
+    return;
+  }
 
-  generateAndValidate(self->ai, self->prompt, description, NULL);
+  if (self->progressive) {
+    strFmt(description, "%s", bufAt(object->descriptions, object->state));
+    prefetchRevalidate(self, NULL, object);
+    return;
+  }
 
-  char *copy = strdup(description->data);
-  (void)mapSet(self->descriptions, cache_key, copy);
-  debug("written cache at: %s\n", cache_key);
+  summarizeObject(object, self->summary);
+  if (narrateObject(self, self->summary, description, true)) {
+    rememberArchived(self, cache_key, archive_key, description->data, object);
+  }
 }
 
-void masterDescribeAction(master_t *self, const world_t *world,
-                          const string_t *input, const object_t *object,
-                          const object_t *transition_target,
-                          object_state_t transition_target_initial_state,
-                          string_t *comment) {
-  const config_t *config = self->ai->configuration;
-  const string_t *sys_prompt_tpl = config->prompt_templates[PROMPT_TYPE_SYS];
-  const string_t *usr_prompt_tpl = config->prompt_templates[PROMPT_TYPE_USR];
-  const string_t *res_prompt_tpl = config->prompt_templates[PROMPT_TYPE_RES];
+void masterDescribeObject(master_t *self, const object_t *object,
+                          string_t *description) {
+  prefetchYield(self);
+  describeObject(self, object, description);
+  prefetchResume(self);
+}
 
+static void describeAction(master_t *self, const world_t *world,
+                           const string_t *input, const object_t *object,
+                           const object_t *transition_target,
+                           object_state_t transition_target_initial_state,
+                           string_t *comment) {
   // Need to do it first, else it scrambles the self->prompt
-  masterDescribeLocation(self, world->location, self->summary);
-
-  strFmt(self->prompt, sys_prompt_tpl->data, MASTER_ACTION_SYS_PROMPT.data);
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, "look around");
-  strFmtAppend(self->prompt, res_prompt_tpl->data, self->summary->data);
+  describeLocation(self, world->location, self->summary, false);
+
+  // Previous turns stay in the prompt, for context, after the instructions
+  const ai_t *ai = self->ai;
+  tokens_t *session = self->session;
+  const size_t turn_start = session->len;
+  ai_result_t result =
+      aiPromptAppend(ai, session, PROMPT_TYPE_USR, "look around");
+  if (result == AI_RESULT_OK) {
+    result = aiPromptAppend(ai, session, PROMPT_TYPE_RES, self->summary->data);
+  }
 
   if (transition_target && transition_target != object) {
     char *target_initial_desc =
@@ -328,10 +1007,53 @@ void masterDescribeAction(master_t *self, const world_t *world,
            bufAt(object->descriptions, object->state));
   }
 
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, self->summary->data);
-  strFmtAppend(self->prompt, res_prompt_tpl->data, "");
+  if (result == AI_RESULT_OK) {
+    result = aiPromptAppend(ai, session, PROMPT_TYPE_USR, self->summary->data);
+  }
+  if (result == AI_RESULT_OK) {
+    result = aiPromptAppend(ai, session, PROMPT_TYPE_RES, "");
+  }
+
+  // Failing to build the prompt fails the generation
+  self->prompt->len = 0;
+  size_t turn_len = session->len - turn_start;
+  if (result != AI_RESULT_OK) {
+    error("Prompt exceeds the context size");
+    session->len = turn_start;
+    turn_len = 0;
+  } else {
+    sessionFit(self, turn_len);
+    promptStart(self, self->action_prompt);
+    if (aiPromptAppendTokens(self->prompt, session) != AI_RESULT_OK) {
+      self->prompt->len = 0;
+    }
+  }
+
+  const int valid = generateAndValidate(self, self->prompt, comment,
+                                        &ACTION_MUST_HAVES, true);
+  if (turn_len == 0) {
+    return;
+  }
+
+  // The response completes the turn, which is kept for the next ones
+  const size_t prompt_len = session->len;
+  if (!valid ||
+      aiPromptAppendText(ai, session, comment->data) != AI_RESULT_OK) {
+    session->len -= turn_len;
+    return;
+  }
+  bufPush(self->turns, turn_len + session->len - prompt_len);
+}
 
-  generateAndValidate(self->ai, self->prompt, comment, &ACTION_MUST_HAVES);
+void masterDescribeAction(master_t *self, const world_t *world,
+                          const string_t *input, const object_t *object,
+                          const object_t *transition_target,
+                          object_state_t transition_target_initial_state,
+                          string_t *comment) {
+  prefetchYield(self);
+  describeAction(self, world, input, object, transition_target,
+                 transition_target_initial_state, comment);
+  prefetchResume(self);
 }
 
 void masterDescribeEndGame(master_t *self, const string_t *last_action,
@@ -342,48 +1064,333 @@ void masterDescribeEndGame(master_t *self, const string_t *last_action,
     return;
   }
 
-  const config_t *config = self->ai->configuration;
-  const string_t *sys_prompt_tpl = config->prompt_templates[PROMPT_TYPE_SYS];
-  const string_t *usr_prompt_tpl = config->prompt_templates[PROMPT_TYPE_USR];
-  const string_t *res_prompt_tpl = config->prompt_templates[PROMPT_TYPE_RES];
-
+  prefetchYield(self);
   // Need to do it before everything, else it scrambles the prompt
-  masterDescribeLocation(self, world->location, self->summary);
-
-  strFmt(self->prompt, sys_prompt_tpl->data, MASTER_END_GAME_SYS_PROMPT.data);
+  describeLocation(self, world->location, self->summary, false);
 
-  // Using a shot to provide some context
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, "look around");
-  strFmtAppend(self->prompt, res_prompt_tpl->data, self->summary->data);
+  promptStart(self, self->end_game_prompt);
+  promptAppend(self, PROMPT_TYPE_RES, self->summary->data);
 
   strFmt(self->summary, "ACTION: %s\nENDING: %s\nREASON: %s", last_action->data,
          state == GAME_STATE_VICTORY ? "victory" : "death", world->end_game);
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, self->summary->data);
-  strFmtAppend(self->prompt, res_prompt_tpl->data, "");
+  promptAppend(self, PROMPT_TYPE_USR, self->summary->data);
+  promptAppend(self, PROMPT_TYPE_RES, "");
 
-  generateAndValidate(self->ai, self->prompt, description, &ACTION_MUST_HAVES);
+  generateAndValidate(self, self->prompt, description, &ACTION_MUST_HAVES,
+                      true);
+  prefetchResume(self);
 }
 
 void masterForget(master_t *self, const object_t *object,
                   const char *namespace) {
-  map_key_t cache_key = makeCacheKey(object->name, namespace);
-  char *value = mapDelete(self->descriptions, cache_key);
-  deallocate(&value);
+  char cache_key[MASTER_CACHE_KEY_LENGTH];
+  makeCacheKey(cache_key, object->name, namespace);
+  memoryLock(self);
+  if (self->prefetch)
+    self->prefetch->epoch++;
+  memoryForget(self, cache_key);
+  memoryUnlock(self);
+}
+
+static void *prefetchLoop(void *data) {
+  prefetch_t *prefetch = data;
+  master_t *master = prefetch->master;
+
+  pthread_mutex_lock(&prefetch->lock);
+  while (true) {
+    // Jobs queued while the master narrates wait for it to give the model back
+    while (!prefetch->quit && (prefetch->next == prefetch->queued ||
+                               atomic_load(&prefetch->yield))) {
+      pthread_cond_wait(&prefetch->signal, &prefetch->lock);
+    }
+    if (prefetch->quit)
+      break;
+
+    // Jobs can be replaced as soon as the lock is released: this one is
+    // copied, to generate from it without holding the lock
+    // Only the thread running the game checks whether descriptions are
+    // stale: the worker does not read the world
+    const prefetch_job_t *job = &prefetch->jobs[prefetch->next++];
+    if (mapGet(master->descriptions, job->key))
+      continue;
+
+    char cache_key[MASTER_CACHE_KEY_LENGTH];
+    memcpy(cache_key, job->key, sizeof(cache_key));
+    const bool location = job->location;
+    const memory_source_t source = job->source;
+    const archive_key_t archive_key = job->archive_key;
+    strFmt(prefetch->summary, "%s", job->summary->data);
+    prefetch->must_haves->len = 0;
+    bufCat(prefetch->must_haves, job->must_haves);
+    const uint64_t epoch = prefetch->epoch;
+    prefetch->busy = true;
+    prefetch->current = source;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    debug("prefetching: %s\n", cache_key);
+    const int valid =
+        location ? narrateLocation(prefetch->worker, prefetch->summary,
+                                   prefetch->must_haves,
+                                   prefetch->description, false)
+                 : narrateObject(prefetch->worker, prefetch->summary,
+                                 prefetch->description, false);
+
+    // The master might have described it meanwhile, or changed the world
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->busy = false;
+    pthread_cond_broadcast(&prefetch->signal);
+    if (valid && epoch == prefetch->epoch &&
+        !mapGet(master->descriptions, cache_key)) {
+      store(master, cache_key, prefetch->description->data, source);
+      persist(master, archive_key, prefetch->description->data);
+    }
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+  return NULL;
+}
+
+static void prefetchDestroy(prefetch_t **self) {
+  if (!self || !*self)
+    return;
+
+  prefetch_t *prefetch = *self;
+  if (prefetch->started) {
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->quit = true;
+    atomic_store(&prefetch->yield, true);
+    pthread_cond_broadcast(&prefetch->signal);
+    pthread_mutex_unlock(&prefetch->lock);
+    pthread_join(prefetch->tid, NULL);
+  }
+  pthread_cond_destroy(&prefetch->signal);
+  pthread_mutex_destroy(&prefetch->lock);
+
+  for (size_t i = 0; i < MASTER_PREFETCH; i++) {
+    strDestroy(&prefetch->jobs[i].summary);
+    wordsDestroy(&prefetch->jobs[i].must_haves);
+  }
+  masterDestroy(&prefetch->worker);
+  strDestroy(&prefetch->summary);
+  wordsDestroy(&prefetch->must_haves);
+  strDestroy(&prefetch->description);
+  deallocate(self);
+}
+
+static prefetch_t *prefetchCreate(master_t *master, world_t *world) {
+  prefetch_t *prefetch = allocate(sizeof(prefetch_t));
+  if (!prefetch)
+    return NULL;
+
+  pthread_mutex_init(&prefetch->lock, NULL);
+  pthread_cond_init(&prefetch->signal, NULL);
+  prefetch->master = master;
+
+  // Must-haves are at most every item and every location of the world
+  const size_t words = world->items->len + world->locations->len;
+  bool allocated = true;
+  for (size_t i = 0; i < MASTER_PREFETCH; i++) {
+    prefetch->jobs[i].summary = strCreate(4096);
+    prefetch->jobs[i].must_haves = wordsCreate(words);
+    allocated = allocated && prefetch->jobs[i].summary &&
+                prefetch->jobs[i].must_haves;
+  }
+  prefetch->worker = masterCreateOn(world, master->ai, &prefetch->yield);
+  prefetch->summary = strCreate(4096);
+  prefetch->must_haves = wordsCreate(words);
+  prefetch->description = strCreate(4096);
+  if (!allocated || !prefetch->worker || !prefetch->summary ||
+      !prefetch->must_haves || !prefetch->description) {
+    prefetchDestroy(&prefetch);
+    return NULL;
+  }
+  prefetch->started =
+      pthread_create(&prefetch->tid, NULL, prefetchLoop, prefetch) == 0;
+  if (!prefetch->started) {
+    prefetchDestroy(&prefetch);
+    return NULL;
+  }
+  return prefetch;
+}
+
+// Queues a description unless it is known, archived, or queued already,
+// returning the job to fill in. Requires the lock.
+static prefetch_job_t *prefetchQueue(master_t *self, const object_t *object,
+                                     const char *namespace,
+                                     const location_t *location) {
+  prefetch_t *prefetch = self->prefetch;
+  if (prefetch->queued == MASTER_PREFETCH)
+    return NULL;
+
+  prefetch_job_t *job = &prefetch->jobs[prefetch->queued];
+  makeCacheKey(job->key, object->name, namespace);
+  job->source = memorySource(object);
+  job->archive_key = archiveKey(self, namespace, object, location);
+  if (memoryGet(self, job->key) ||
+      unarchive(self, job->key, job->archive_key, job->source))
+    return NULL;
+
+  for (size_t i = prefetch->next; i < prefetch->queued; i++) {
+    if (strcmp(prefetch->jobs[i].key, job->key) == 0)
+      return NULL;
+  }
+
+  prefetch->queued++;
+  return job;
+}
+
+static void prefetchLocation(master_t *self, const location_t *location) {
+  prefetch_job_t *job =
+      prefetchQueue(self, &location->object, LOCATION_NAMESPACE, location);
+  if (job) {
+    job->location = true;
+    summarizeLocation(location, job->summary);
+    locationMustHaves(location, job->must_haves);
+  }
+}
+
+static void prefetchObject(master_t *self, const object_t *object) {
+  prefetch_job_t *job = prefetchQueue(self, object, OBJECT_NAMESPACE, NULL);
+  if (job) {
+    job->location = false;
+    summarizeObject(object, job->summary);
+  }
+}
+
+// Queues the narration of a description shown as authored. Stale ones are
+// queued again by masterPrefetch, until they are in memory.
+static void prefetchRevalidate(master_t *self, const location_t *location,
+                               const object_t *object) {
+  prefetch_t *prefetch = self->prefetch;
+  if (!prefetch)
+    return;
+
+  pthread_mutex_lock(&prefetch->lock);
+  bool known = false;
+  for (size_t i = 0; i < prefetch->stales; i++) {
+    const prefetch_stale_t *stale = &prefetch->stale[i];
+    known = known || (stale->location == location && stale->object == object);
+  }
+  if (!known && prefetch->stales < MASTER_PREFETCH) {
+    prefetch->stale[prefetch->stales++] =
+        (prefetch_stale_t){.location = location, .object = object};
+  }
+
+  if (location) {
+    prefetchLocation(self, location);
+  } else {
+    prefetchObject(self, object);
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+// Drops the stale descriptions narrated already, and queues the others
+static void prefetchStale(master_t *self) {
+  prefetch_t *prefetch = self->prefetch;
+  char cache_key[MASTER_CACHE_KEY_LENGTH];
+
+  size_t stales = 0;
+  for (size_t i = 0; i < prefetch->stales; i++) {
+    const prefetch_stale_t stale = prefetch->stale[i];
+    if (stale.location) {
+      makeCacheKey(cache_key, stale.location->object.name, LOCATION_NAMESPACE);
+    } else {
+      makeCacheKey(cache_key, stale.object->name, OBJECT_NAMESPACE);
+    }
+    if (memoryGet(self, cache_key))
+      continue;
+
+    prefetch->stale[stales++] = stale;
+    if (stale.location) {
+      prefetchLocation(self, stale.location);
+    } else {
+      prefetchObject(self, stale.object);
+    }
+  }
+  prefetch->stales = stales;
+}
+
+static bool prefetchStart(master_t *self, world_t *world) {
+  if (!self->prefetch) {
+    self->prefetch = prefetchCreate(self, world);
+    if (!self->prefetch) {
+      error("cannot start prefetching descriptions");
+    }
+  }
+  return self->prefetch != NULL;
+}
+
+void masterPrefetch(master_t *self, world_t *world) {
+  if (!prefetchStart(self, world))
+    return;
+
+  prefetch_t *prefetch = self->prefetch;
+  const location_t *location = world->location;
+
+  // The world is read here, as the game waits for the player. The worker
+  // only reads what is gathered in the jobs.
+  pthread_mutex_lock(&prefetch->lock);
+  prefetch->next = prefetch->queued = 0;
+  prefetchStale(self);
+
+  size_t i = 0;
+  bufEach(location->exits, i) {
+    prefetchLocation(self, (location_t *)bufAt(location->exits, i));
+  }
+
+  bufEach(location->items, i) {
+    prefetchObject(self, &bufAt(location->items, i)->object);
+  }
+
+  atomic_store(&prefetch->yield, false);
+  pthread_cond_broadcast(&prefetch->signal);
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+void masterSetProgressive(master_t *self, world_t *world) {
+  self->progressive = prefetchStart(self, world);
+}
+
+void masterOpenArchive(master_t *self, const world_t *world,
+                       const char *path) {
+  archive_t *archive = archiveOpen(path, MASTER_ARCHIVE_FORMAT);
+  if (!archive) {
+    error("cannot open archive at %s", path);
+    return;
+  }
+
+  memoryLock(self);
+  archiveClose(&self->archive);
+  self->archive = archive;
+  self->archive_seed = archiveSeed(world);
+  memoryUnlock(self);
 }
 
 void masterDestroy(master_t **self) {
   if (!self || !*self)
     return;
 
-  aiDestroy(&(*self)->ai);
-  strDestroy(&(*self)->prompt);
+  prefetchDestroy(&(*self)->prefetch);
+  archiveClose(&(*self)->archive);
+  aiPromptDestroy(&(*self)->prompt);
+  aiPromptDestroy(&(*self)->location_prompt);
+  aiPromptDestroy(&(*self)->object_prompt);
+  aiPromptDestroy(&(*self)->action_prompt);
+  aiPromptDestroy(&(*self)->end_game_prompt);
+  aiPromptDestroy(&(*self)->session);
+  turnsDestroy(&(*self)->turns);
+  // Prefetchers borrow the model of their master
+  if (!(*self)->yield)
+    aiDestroy(&(*self)->ai);
   strDestroy(&(*self)->summary);
+  candidatesDestroy(&(*self)->candidates);
 
-  for (map_size_t i = 0; i < (*self)->descriptions->size; i++) {
-    char *memory = (*self)->descriptions->values[i];
-    deallocate(&memory);
+  if ((*self)->descriptions) {
+    for (map_size_t i = 0; i < (*self)->descriptions->size; i++) {
+      memory_t *memory = (*self)->descriptions->values[i];
+      memoryDestroy(*self, &memory);
+    }
+    mapDestroy(&(*self)->descriptions);
   }
-  mapDestroy(&(*self)->descriptions);
 
   deallocate(self);
 }
@@ -1,24 +1,147 @@
 #pragma once
 
 #include "ai.h"
+#include "lib/archive.h"
 #include "lib/buffers.h"
 #include "lib/map.h"
 #include "world/object.h"
 #include "world/world.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+// Receives portions of a description while it is being generated
+typedef void (*master_stream_callback_t)(const char *, size_t, void *);
+
+// Length in tokens of each turn of a session
+typedef Buffer(size_t) turns_t;
+
+typedef struct master_t master_t;
+
+// This is only exposed to speed up unit tests.
+// Else to test this functionality we would need to depend on ai instantiation
+typedef Buffer(const char *) words_t;
+
+#define MASTER_CACHE_KEY_LENGTH 256
+// Most bytes of descriptions kept in memory, before forgetting the least
+// recently used ones
+#define MASTER_MEMORY_BYTES (128 * 1024)
+
+// Format of the archived descriptions. Bump it whenever descriptions would
+// come out differently for the same world, model, and prompts.
+#define MASTER_ARCHIVE_FORMAT 1
+
+// The object a description is made from, as it was then. The description holds
+// as long as the object keeps the same state and version.
+typedef struct {
+  const object_t *object;
+  object_state_t state;
+  uint32_t version;
+} memory_source_t;
+
+// A description kept in memory
+typedef struct {
+  char *text;
+  memory_source_t source;
+  // When it was last used, on the clock of the master
+  uint64_t used;
+} memory_t;
+// Most descriptions queued to be generated ahead of time
+#define MASTER_PREFETCH 16
+
+// A description to generate ahead of time, with everything it needs from the
+// world gathered when it is queued
+typedef struct {
+  char key[MASTER_CACHE_KEY_LENGTH];
+  bool location;
+  string_t *summary;
+  words_t *must_haves;
+  memory_source_t source;
+  archive_key_t archive_key;
+} prefetch_job_t;
+
+// Shown with the authored description, still to be narrated. Either field is
+// set, depending on the namespace.
+typedef struct {
+  const location_t *location;
+  const object_t *object;
+} prefetch_stale_t;
+
+// Generates the descriptions the player is likely to ask for next on its own
+// thread, while the player reads and types. It narrates on the model context
+// of the master, whenever the master does not need it.
+typedef struct {
+  pthread_t tid;
+  bool started;
+  master_t *master;
+  // Guards the fields below, and the memory of descriptions of the master
+  pthread_mutex_t lock;
+  pthread_cond_t signal;
+  prefetch_job_t jobs[MASTER_PREFETCH];
+  size_t next;
+  size_t queued;
+  // Narrated before anything else, until they are in memory
+  prefetch_stale_t stale[MASTER_PREFETCH];
+  size_t stales;
+  // Bumped whenever a description is forgotten, or the object being narrated
+  // changes: those generated meanwhile might be stale, and are dropped
+  uint64_t epoch;
+  bool quit;
+  // Set when the master needs its model: the description being generated is
+  // abandoned at the next token, and so are the queued ones
+  atomic_bool yield;
+  // Whether the worker is using the model, and for which object
+  bool busy;
+  memory_source_t current;
+  // Narrates from copies of the jobs, borrowing the model of the master
+  master_t *worker;
+  string_t *summary;
+  words_t *must_haves;
+  string_t *description;
+} prefetch_t;
+
 // This class represent the Game Master. It's the AI recounting the state of
 // the world, describing situations and locations. It has a memory such that
 // descriptions don't have to be recreated from scratch every time.
 // Unless differently specified, descriptions will be memorised.
-typedef struct {
+typedef struct master_t {
   ai_t *ai;
-  string_t *prompt;
+  tokens_t *prompt;
+  // Instructions opening each kind of prompt, tokenized once
+  tokens_t *location_prompt;
+  tokens_t *object_prompt;
+  tokens_t *action_prompt;
+  tokens_t *end_game_prompt;
+  // Recent turns of the action narration, following its instructions. The
+  // oldest are forgotten to make room for new ones, also in the KV cache.
+  tokens_t *session;
+  turns_t *turns;
   string_t *summary;
+  // Responses generated in parallel for every description
+  strings_t *candidates;
+  // Descriptions by namespace and name, as memory_t
   map_t *descriptions;
+  // Bytes of the descriptions in memory, and clock of their use
+  size_t memory_bytes;
+  uint64_t memory_clock;
+  // Descriptions of the previous sessions, once opened. Guarded by the same
+  // lock as the memory.
+  archive_t *archive;
+  // Identifies the world, model, and prompts in the keys of the archive
+  archive_key_t archive_seed;
+  master_stream_callback_t stream;
+  void *stream_data;
+  // Started by the first masterPrefetch
+  prefetch_t *prefetch;
+  // Whether descriptions not in memory are shown as authored in the story,
+  // while narrated in the background for the next time
+  bool progressive;
+  // Abandons the generation in progress when set. Only used by prefetchers.
+  atomic_bool *yield;
 } master_t;
 
 // Namespaces in memory. The same object can be described generically as an
@@ -30,6 +153,12 @@ extern const char *OBJECT_NAMESPACE;
 // Allocate the master and related resources
 master_t *masterCreate(world_t *world);
 
+// Forward generated descriptions to the callback sentence by sentence, as soon
+// as they are validated. The text received is the final description: rejected
+// attempts are never streamed. Cached descriptions are not streamed.
+// Passing NULL disables streaming.
+void masterSetStream(master_t *, master_stream_callback_t, void *);
+
 // Describe the given location and writes the output to provided string.
 // The input string will be truncated.
 void masterDescribeLocation(master_t *, const location_t *, string_t *);
@@ -55,12 +184,26 @@ void masterDescribeEndGame(master_t *, const string_t *, const world_t *,
 // Forget the description of a given object that was previously described.
 void masterForget(master_t *, const object_t *, const char *);
 
+// Generates in the background the descriptions of the exits of the current
+// location and of its items, unless already known, replacing those queued
+// before. Any other request to the master interrupts it, to have the model
+// for itself.
+void masterPrefetch(master_t *, world_t *);
+
+// Shows the authored descriptions of locations and objects when they are not
+// in memory, instead of waiting for them to be narrated. Narrated ones are
+// generated in the background, and used from the next time on.
+void masterSetProgressive(master_t *, world_t *);
+
+// Keeps the descriptions in the file at the path, to find them again in the
+// next sessions with the same story. Descriptions are looked up lazily, when
+// missing from memory.
+void masterOpenArchive(master_t *, const world_t *, const char *);
+
 // Destroys master and all associated resources
 void masterDestroy(master_t **);
 
-// This is only exposed to speed up unit tests.
-// Else to test this functionality we would need to depend on ai instantiation
-typedef Buffer(const char *) words_t;
+// Helpers for words_t, declared above
 words_t *wordsCreate(size_t len);
 void wordsDestroy(words_t **self);
 int masterIsValidResponse(string_t *, words_t *);
@@ -3,10 +3,10 @@
 #include "lib/panic.h"
 #include "utils.h"
 #include "world/action.h"
+#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
-
-static string_t ACTION_GRAMMAR = strConst(
-    "root ::= \"move\" | \"use\" | \"take\" | \"drop\" | \"examine\"\n");
+#include <string.h>
 
 typedef struct {
   const char *input;
@@ -40,11 +40,62 @@ static action_shot_t action_shots[] = {
     {"throw the rock", &ACTION_DROP},
 };
 
-static const char *item_shots_tpls[] = {"look at the %s", "grab the %s",
-                                        "use %s on chest", "check behind %s",
-                                        "pick up %s"};
+typedef struct {
+  const char *verb;
+  action_type_t action;
+} verb_t;
+
+// Verbs that can only mean one action, in normalized form. Verbs like "leave"
+// (the key or the room?) or "head" are deliberately left to the model. The
+// first match wins, so longer phrases come first.
+static verb_t verbs[] = {
+    {"go", ACTION_TYPE_MOVE},         {"walk", ACTION_TYPE_MOVE},
+    {"move", ACTION_TYPE_MOVE},       {"enter", ACTION_TYPE_MOVE},
+    {"run", ACTION_TYPE_MOVE},        {"travel", ACTION_TYPE_MOVE},
+
+    {"take a look", ACTION_TYPE_EXAMINE},
+    {"take", ACTION_TYPE_TAKE},       {"grab", ACTION_TYPE_TAKE},
+    {"pick up", ACTION_TYPE_TAKE},    {"get", ACTION_TYPE_TAKE},
+    {"collect", ACTION_TYPE_TAKE},    {"fetch", ACTION_TYPE_TAKE},
+
+    {"drop", ACTION_TYPE_DROP},       {"put", ACTION_TYPE_DROP},
+    {"discard", ACTION_TYPE_DROP},    {"lay", ACTION_TYPE_DROP},
+
+    {"use", ACTION_TYPE_USE},         {"open", ACTION_TYPE_USE},
+    {"push", ACTION_TYPE_USE},        {"pull", ACTION_TYPE_USE},
+    {"eat", ACTION_TYPE_USE},         {"activate", ACTION_TYPE_USE},
+
+    {"examine", ACTION_TYPE_EXAMINE}, {"look", ACTION_TYPE_EXAMINE},
+    {"inspect", ACTION_TYPE_EXAMINE}, {"read", ACTION_TYPE_EXAMINE},
+    {"check", ACTION_TYPE_EXAMINE},   {"observe", ACTION_TYPE_EXAMINE},
+};
+
+// Politeness preceding the verb, in normalized form
+static const char *fillers[] = {"please", "i want to", "i d like to",
+                                "let s", "lets", "try to", "then"};
+
+typedef struct {
+  const char *input;
+  const char *output;
+} command_shot_t;
+
+// Names here need not exist in the world: they only show the format
+static command_shot_t command_shots[] = {
+    {"walk over to the garden", "move Garden"},
+    {"snatch the golden key", "take Golden Key"},
+    {"let the coin fall on the floor", "drop Coin"},
+    {"have a look at the painting", "examine Painting"},
+    {"cut the vines with the shears", "use Garden Shears on Overgrown Vines"},
+    {"sing a song", "unknown"},
+};
+
+#define TEMPLATE_SHOTS 5
 
-static const char *location_shots_tpls[] = {
+static const char *item_shots_tpls[TEMPLATE_SHOTS] = {
+    "look at the %s", "grab the %s", "use %s on chest", "check behind %s",
+    "pick up %s"};
+
+static const char *location_shots_tpls[TEMPLATE_SHOTS] = {
     "walk to %s", "enter %s", "go to %s", "move to %s", "run towards %s"};
 
 parser_t *parserCreate(void) {
@@ -55,18 +106,446 @@ parser_t *parserCreate(void) {
   parser->ai = aiCreate(&PARSER_CONFIG, &result);
   panicif(!parser->ai, "cannot allocate AI for parser");
 
-  parser->prompt = strCreate(4096);
+  parser->intent = intentCreate();
+  panicif(!parser->intent, "cannot allocate intent classifier");
+  for (size_t i = 0; i < arrLen(action_shots); i++) {
+    for (size_t j = 0; j < ACTION_TYPES; j++) {
+      if (action_shots[i].output == action_names[j]) {
+        intentTrain(parser->intent, action_shots[i].input, actions_types[j]);
+      }
+    }
+  }
+
+  parser->prompt = aiPromptCreate(parser->ai);
   panicif(!parser->prompt, "cannot allocate prompt buffer");
 
+  parser->shots = PARSER_SHOTS;
+  parser->action_system = aiPromptCreate(parser->ai);
+  panicif(!parser->action_system, "cannot allocate prompt buffer");
+  result = aiPromptAppend(parser->ai, parser->action_system, PROMPT_TYPE_SYS,
+                          PARSER_ACTION_SYS_PROMPT.data);
+  panicif(result != AI_RESULT_OK, "cannot tokenize action prompt");
+
+  // Instructions and shots of the fixed action prompt never change
+  parser->action_prompt = aiPromptCreate(parser->ai);
+  panicif(!parser->action_prompt, "cannot allocate prompt buffer");
+  result = aiPromptAppend(parser->ai, parser->action_prompt, PROMPT_TYPE_SYS,
+                          PARSER_ACTION_SYS_PROMPT.data);
+  for (size_t i = 0; i < arrLen(action_shots) && result == AI_RESULT_OK; i++) {
+    action_shot_t shot = action_shots[i];
+    result = aiPromptAppend(parser->ai, parser->action_prompt, PROMPT_TYPE_USR,
+                            shot.input);
+    if (result == AI_RESULT_OK) {
+      result = aiPromptAppend(parser->ai, parser->action_prompt,
+                              PROMPT_TYPE_RES, shot.output->data);
+    }
+  }
+  panicif(result != AI_RESULT_OK, "cannot tokenize action prompt");
+
+  parser->target_prompt = aiPromptCreate(parser->ai);
+  panicif(!parser->target_prompt, "cannot allocate prompt buffer");
+  result = aiPromptAppend(parser->ai, parser->target_prompt, PROMPT_TYPE_SYS,
+                          PARSER_TARGET_SYS_PROMPT.data);
+  panicif(result != AI_RESULT_OK, "cannot tokenize target prompt");
+
+  parser->command_prompt = aiPromptCreate(parser->ai);
+  panicif(!parser->command_prompt, "cannot allocate prompt buffer");
+  result = aiPromptAppend(parser->ai, parser->command_prompt, PROMPT_TYPE_SYS,
+                          PARSER_COMMAND_SYS_PROMPT.data);
+  for (size_t i = 0; i < arrLen(command_shots) && result == AI_RESULT_OK;
+       i++) {
+    command_shot_t shot = command_shots[i];
+    result = aiPromptAppend(parser->ai, parser->command_prompt,
+                            PROMPT_TYPE_USR, shot.input);
+    if (result == AI_RESULT_OK) {
+      result = aiPromptAppend(parser->ai, parser->command_prompt,
+                              PROMPT_TYPE_RES, shot.output);
+    }
+  }
+  panicif(result != AI_RESULT_OK, "cannot tokenize command prompt");
+
   parser->response = strCreate(128);
   panicif(!parser->response, "cannot allocate response buffer");
 
-  parser->target_grammar = strCreate(4096);
-  panicif(!parser->target_grammar, "cannot allocate grammar buffer");
+  parser->command_choices = strCreate(16384);
+  panicif(!parser->command_choices, "cannot allocate choices buffer");
+
+  parser->matches = bktreeMatchesCreate(PARSER_MATCHES);
+  panicif(!parser->matches, "cannot allocate matches buffer");
 
   return parser;
 }
 
+// Returns the text following the words, if the text starts with them
+static const char *skipWords(const char *text, const char *words) {
+  const size_t len = strlen(words);
+  if (strncmp(text, words, len) != 0) {
+    return NULL;
+  }
+
+  if (text[len] == ' ') {
+    return text + len + 1;
+  }
+  return text[len] == '\0' ? text + len : NULL;
+}
+
+// Finds the action from the first verb of the input, without the model
+static action_type_t matchVerb(const string_t *input) {
+  char normalized[OBJECT_NAME_NORMALIZED_LENGTH];
+  objectNameNormalize(input->data, normalized);
+
+  const char *text = normalized;
+  size_t i = 0;
+  while (i < arrLen(fillers)) {
+    const char *rest = skipWords(text, fillers[i]);
+    if (rest) {
+      text = rest;
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+
+  for (i = 0; i < arrLen(verbs); i++) {
+    if (skipWords(text, verbs[i].verb)) {
+      return verbs[i].action;
+    }
+  }
+  return ACTION_TYPE_UNKNOWN;
+}
+
+// Whether the name appears as whole words in the normalized text
+static int containsName(const char *text, const char *name) {
+  const size_t len = strlen(name);
+  if (len == 0) {
+    return 0;
+  }
+
+  for (const char *found = strstr(text, name); found;
+       found = strstr(found + 1, name)) {
+    const int starts = found == text || found[-1] == ' ';
+    const int ends = found[len] == ' ' || found[len] == '\0';
+    if (starts && ends) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Finds the only candidate named in the input, without the model. Names found
+// within the longest one do not count: "golden key" wins over "key". Returns
+// the index among locations followed by items, or -1 if there is no such name.
+static int matchName(const string_t *input, const locations_t *locations,
+                     const items_t *items) {
+  char text[OBJECT_NAME_NORMALIZED_LENGTH];
+  char best[OBJECT_NAME_NORMALIZED_LENGTH] = {};
+  char name[OBJECT_NAME_NORMALIZED_LENGTH];
+  objectNameNormalize(input->data, text);
+
+  const size_t count = locations->len + items->len;
+  int result = -1;
+  for (size_t i = 0; i < count; i++) {
+    const object_t *object = i < locations->len
+                                 ? &bufAt(locations, i)->object
+                                 : &bufAt(items, i - locations->len)->object;
+    objectNameNormalize(object->name, name);
+    if (containsName(text, name) && strlen(name) > strlen(best)) {
+      strcpy(best, name);
+      result = (int)i;
+    }
+  }
+
+  if (result < 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const object_t *object = i < locations->len
+                                 ? &bufAt(locations, i)->object
+                                 : &bufAt(items, i - locations->len)->object;
+    objectNameNormalize(object->name, name);
+    if ((int)i != result && containsName(text, name) &&
+        !containsName(best, name)) {
+      return -1;
+    }
+  }
+  return result;
+}
+
+// Edits tolerated when looking up a word of the given length
+static size_t typosAllowed(size_t length) {
+  return length < 6 ? 1 : 2;
+}
+
+// Scores how well the input names the object from the words matched in the
+// index: each word of the name counts for its similarity to the closest input
+// word, and words that were not matched count against it.
+static float fuzzyScore(const object_t *object,
+                        const bktree_matches_t *matches) {
+  char name[OBJECT_NAME_NORMALIZED_LENGTH];
+  objectNameNormalize(object->name, name);
+
+  float score = 0;
+  char *state = NULL;
+  for (char *word = strtok_r(name, " ", &state); word;
+       word = strtok_r(NULL, " ", &state)) {
+    const size_t length = strlen(word);
+    if (length < OBJECT_NAME_MIN_WORD)
+      continue;
+
+    float best = -0.5f;
+    size_t i = 0;
+    bufEach(matches, i) {
+      const bktree_match_t match = bufAt(matches, i);
+      if (match.value != object || strcmp(match.key, word) != 0)
+        continue;
+
+      const float similarity = 1.0f - (float)match.distance / (float)length;
+      if (similarity > best)
+        best = similarity;
+    }
+    score += best;
+  }
+  return score;
+}
+
+// Finds the candidate named in the input despite typos, looking up each input
+// word among the world names. Gives up unless one candidate clearly scores
+// better than all the others. Returns the index among locations followed by
+// items, or -1 if there is no such candidate.
+static int fuzzyMatchName(parser_t *self, const string_t *input,
+                          const locations_t *locations, const items_t *items) {
+  if (!self->names) {
+    return -1;
+  }
+
+  char text[OBJECT_NAME_NORMALIZED_LENGTH];
+  objectNameNormalize(input->data, text);
+
+  self->matches->len = 0;
+  char *state = NULL;
+  for (char *word = strtok_r(text, " ", &state); word;
+       word = strtok_r(NULL, " ", &state)) {
+    const size_t length = strlen(word);
+    if (length >= OBJECT_NAME_MIN_WORD) {
+      bktreeSearch(self->names, word, typosAllowed(length), self->matches);
+    }
+  }
+
+  const size_t count = locations->len + items->len;
+  int result = -1;
+  float best = 0, second = 0;
+  for (size_t i = 0; i < count; i++) {
+    const object_t *object = i < locations->len
+                                 ? &bufAt(locations, i)->object
+                                 : &bufAt(items, i - locations->len)->object;
+
+    int matched = 0;
+    size_t j = 0;
+    for (j = 0; j < self->matches->len && !matched; j++) {
+      matched = bufAt(self->matches, j).value == object;
+    }
+    if (!matched)
+      continue;
+
+    const float score = fuzzyScore(object, self->matches);
+    if (result < 0 || score > best) {
+      second = result < 0 ? second : best;
+      best = score;
+      result = (int)i;
+    } else if (score > second) {
+      second = score;
+    }
+  }
+
+  if (result < 0 || best < 0.5f || best - second < 0.5f) {
+    return -1;
+  }
+  return result;
+}
+
+// Appends a user message and the assistant response to the prompt
+static ai_result_t appendShot(const ai_t *ai, tokens_t *prompt,
+                              const char *input, const char *output) {
+  ai_result_t result = aiPromptAppend(ai, prompt, PROMPT_TYPE_USR, input);
+  if (result != AI_RESULT_OK) {
+    return result;
+  }
+  return aiPromptAppend(ai, prompt, PROMPT_TYPE_RES, output);
+}
+
+#define EMBEDDED_TEXT_LENGTH 512
+
+static embedded_objects_t *embeddedObjectsCreate(size_t cap) {
+  embedded_objects_t *embedded = NULL;
+  bufCreate(embedded_objects_t, embedded_t, embedded, cap);
+  return embedded;
+}
+
+static size_t objectStates(const object_t *object) {
+  const descriptions_t *descriptions = object->descriptions;
+  return descriptions && descriptions->len > 0 ? descriptions->len : 1;
+}
+
+// Embeds the name of the object followed by the description of each state
+static void embedObject(parser_t *self, const object_t *object, size_t *row) {
+  const embedded_t embedded = {object, *row, objectStates(object)};
+  bufPush(self->embedded, embedded);
+
+  char text[EMBEDDED_TEXT_LENGTH];
+  for (size_t i = 0; i < embedded.states; i++, (*row)++) {
+    if (object->descriptions && object->descriptions->len > 0) {
+      snprintf(text, sizeof(text), "%s: %s", object->name,
+               bufAt(object->descriptions, i));
+    } else {
+      snprintf(text, sizeof(text), "%s", object->name);
+    }
+
+    const ai_result_t result = aiEmbed(
+        self->ai, text, self->embeddings + *row * self->embedding_size);
+    panicif(result != AI_RESULT_OK, "cannot embed object");
+  }
+}
+
+// Embeds every object once per state, into a single matrix, so that inputs
+// can be compared with the description of the state objects are in
+static void embedObjects(parser_t *self, const world_t *world) {
+  size_t rows = 0;
+  size_t i = 0;
+  bufEach(world->locations, i) {
+    rows += objectStates(&bufAt(world->locations, i)->object);
+  }
+  bufEach(world->items, i) {
+    rows += objectStates(&bufAt(world->items, i)->object);
+  }
+
+  self->embedding_size = aiEmbeddingSize(self->ai);
+  self->embeddings = allocate(sizeof(float) * rows * self->embedding_size);
+  panicif(!self->embeddings, "cannot allocate embeddings");
+  self->query = allocate(sizeof(float) * self->embedding_size);
+  panicif(!self->query, "cannot allocate embeddings");
+  self->embedded =
+      embeddedObjectsCreate(world->locations->len + world->items->len);
+  panicif(!self->embedded, "cannot allocate embeddings");
+
+  size_t row = 0;
+  bufEach(world->locations, i) {
+    embedObject(self, &bufAt(world->locations, i)->object, &row);
+  }
+  bufEach(world->items, i) {
+    embedObject(self, &bufAt(world->items, i)->object, &row);
+  }
+
+  self->centroid = allocate(sizeof(float) * self->embedding_size);
+  panicif(!self->centroid, "cannot allocate embeddings");
+  for (row = 0; row < rows; row++) {
+    const float *embedding = self->embeddings + row * self->embedding_size;
+    for (size_t j = 0; j < self->embedding_size; j++) {
+      self->centroid[j] += embedding[j];
+    }
+  }
+
+  float norm = 0;
+  for (size_t j = 0; j < self->embedding_size; j++) {
+    norm += self->centroid[j] * self->centroid[j];
+  }
+  norm = sqrtf(norm);
+  for (size_t j = 0; norm > 0 && j < self->embedding_size; j++) {
+    self->centroid[j] /= norm;
+  }
+}
+
+// Waits for the background decoding to finish, before using the model:
+// the context, its cache and the prompt buffer are not shared
+static void typingPause(parser_t *self) {
+  typing_t *typing = self->typing;
+  if (!typing) {
+    return;
+  }
+
+  pthread_mutex_lock(&typing->lock);
+  typing->pending = 0;
+  strClear(typing->text);
+  while (typing->busy) {
+    pthread_cond_wait(&typing->signal, &typing->lock);
+  }
+  pthread_mutex_unlock(&typing->lock);
+}
+
+void parserPrepare(parser_t *self, const world_t *world) {
+  typingPause(self);
+  self->names = world->names;
+  embedObjects(self, world);
+
+  self->locations = locationsCreate(world->locations->cap);
+  panicif(!self->locations, "cannot allocate locations");
+  self->items = itemsCreate(world->items->cap);
+  panicif(!self->items, "cannot allocate items");
+}
+
+// Tells the action without the model, if possible
+static action_type_t guessAction(parser_t *self, const string_t *input) {
+  if (self->model_only) {
+    return ACTION_TYPE_UNKNOWN;
+  }
+
+  action_type_t action = matchVerb(input);
+  if (action != ACTION_TYPE_UNKNOWN) {
+    debug("matched verb: %s", action_names[action]->data);
+    return action;
+  }
+
+  float confidence = 0;
+  action = intentClassify(self->intent, input->data, &confidence);
+  if (confidence >= INTENT_CONFIDENCE) {
+    debug("classified intent: %s (%.2f)", action_names[action]->data,
+          (double)confidence);
+    return action;
+  }
+  return ACTION_TYPE_UNKNOWN;
+}
+
+// Fills the prompt with the instructions and shots for the action of the text
+static ai_result_t appendActionShots(parser_t *self, const ai_t *ai,
+                                     tokens_t *prompt, const char *text) {
+  prompt->len = 0;
+  if (self->shots == 0) {
+    return aiPromptAppendTokens(prompt, self->action_prompt);
+  }
+
+  // Shots keep the order they were learnt in: inputs picking the same first
+  // ones share the beginning of the prompt, which is then not decoded again
+  size_t nearest[INTENT_SHOTS];
+  const size_t count = intentNearest(self->intent, text, self->shots, nearest);
+  ai_result_t result = aiPromptAppendTokens(prompt, self->action_system);
+  for (size_t i = 0; i < count && result == AI_RESULT_OK; i++) {
+    const intent_shot_t *shot = &self->intent->shots[nearest[i]];
+    result =
+        appendShot(ai, prompt, shot->text, action_names[shot->action]->data);
+  }
+  return result;
+}
+
+// Asks the model for the action, using the given model and prompt buffer
+static action_type_t classifyAction(parser_t *self, ai_t *ai, tokens_t *prompt,
+                                    const string_t *input) {
+  ai_result_t result = appendActionShots(self, ai, prompt, input->data);
+  if (result == AI_RESULT_OK) {
+    result = appendShot(ai, prompt, input->data, "");
+  }
+  panicif(result != AI_RESULT_OK, "cannot tokenize prompt");
+
+  // Scoring the actions takes a single forward pass, unlike generating one
+  size_t best = 0;
+  float margin = 0;
+  result =
+      aiClassify(ai, prompt, action_names, ACTION_TYPES, &best, &margin);
+  panicif(result != AI_RESULT_OK, "cannot classify action");
+  debug("%s: %s (margin %.2f)", input->data, action_names[best]->data,
+        (double)margin);
+  return actions_types[best];
+}
+
 void parserGetOperation(parser_t *self, operation_t *operation,
                         const string_t *input) {
   const int is_command = bufAt(input, 0) == '/';
@@ -96,130 +575,617 @@ void parserGetOperation(parser_t *self, operation_t *operation,
   }
 
   operation->type = OPERATION_TYPE_ACTION;
-  operation->as.action = ACTION_TYPE_UNKNOWN;
+  operation->as.action = guessAction(self, input);
+  if (operation->as.action == ACTION_TYPE_UNKNOWN) {
+    typingPause(self);
+    operation->as.action = classifyAction(self, self->ai, self->prompt, input);
+  }
+}
 
-  const config_t *config = self->ai->configuration;
-  const string_t *sys_prompt_tpl = config->prompt_templates[PROMPT_TYPE_SYS];
-  const string_t *usr_prompt_tpl = config->prompt_templates[PROMPT_TYPE_USR];
-  const string_t *res_prompt_tpl = config->prompt_templates[PROMPT_TYPE_RES];
+// Independent partial sums let the compiler spread the product over vector
+// lanes without reordering floating point additions
+static float dotProduct(const float *restrict a, const float *restrict b,
+                        size_t size) {
+  float sums[8] = {};
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    for (size_t j = 0; j < 8; j++) {
+      sums[j] += a[i + j] * b[i + j];
+    }
+  }
+  for (; i < size; i++) {
+    sums[0] += a[i] * b[i];
+  }
+  return ((sums[0] + sums[1]) + (sums[2] + sums[3])) +
+         ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+}
 
-  strFmt(self->prompt, sys_prompt_tpl->data, PARSER_ACTION_SYS_PROMPT.data);
+// Similarity of the input with the current state of the object
+static float similarity(const parser_t *self, const object_t *object) {
+  size_t i = 0;
+  bufEach(self->embedded, i) {
+    const embedded_t embedded = bufAt(self->embedded, i);
+    if (embedded.object == object) {
+      const size_t state = object->state < embedded.states ? object->state : 0;
+      const float *row =
+          self->embeddings + (embedded.row + state) * self->embedding_size;
+      return dotProduct(self->query, row, self->embedding_size);
+    }
+  }
+  return -1;
+}
 
-  for (size_t i = 0; i < arrLen(action_shots); i++) {
-    action_shot_t shot = action_shots[i];
-    strFmtAppend(self->prompt, usr_prompt_tpl->data, shot.input);
-    strFmtAppend(self->prompt, res_prompt_tpl->data, shot.output->data);
+// Returns the index of the target most similar to the input, as in matchName,
+// if it is similar enough and clearly more than any other one. Also than the
+// centroid of the world, or any input would match the only target around.
+static int embeddingMatchName(parser_t *self, ai_t *ai, const string_t *input,
+                              const locations_t *locations,
+                              const items_t *items) {
+  if (!self->embeddings || locations->len + items->len == 0) {
+    return -1;
   }
 
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, input->data);
-  strFmtAppend(self->prompt, res_prompt_tpl->data, "");
+  const ai_result_t result = aiEmbed(ai, input->data, self->query);
+  panicif(result != AI_RESULT_OK, "cannot embed input");
 
-  ai_result_t result = aiSetGrammar(self->ai, &ACTION_GRAMMAR);
-  panicif(result != AI_RESULT_OK, "cannot set grammar");
-  strClear(self->response);
-  debug("%s", self->prompt->data);
-  result = aiGenerate(self->ai, self->prompt, self->response);
-  panicif(result != AI_RESULT_OK, "cannot generate response");
+  float best = -1, runner_up = -1;
+  int match = -1;
+  for (size_t i = 0; i < locations->len + items->len; i++) {
+    const object_t *object = i < locations->len
+                                 ? &bufAt(locations, i)->object
+                                 : &bufAt(items, i - locations->len)->object;
+    const float score = similarity(self, object);
+    if (score > best) {
+      runner_up = best;
+      best = score;
+      match = (int)i;
+    } else if (score > runner_up) {
+      runner_up = score;
+    }
+  }
 
-  for (size_t i = 0; i < ACTION_TYPES; i++) {
-    if (strEq(self->response, action_names[i])) {
-      operation->as.action = actions_types[i];
-      return;
+  const float baseline =
+      dotProduct(self->query, self->centroid, self->embedding_size);
+  debug("most similar target: %d (%.2f, runner-up %.2f, centroid %.2f)",
+        match, (double)best, (double)runner_up, (double)baseline);
+  if (baseline > runner_up) {
+    runner_up = baseline;
+  }
+  if (best < TARGET_SIMILARITY || best - runner_up < TARGET_SIMILARITY_MARGIN) {
+    return -1;
+  }
+  return match;
+}
+
+// Marks the k templates most similar to the input, or all of them without k
+static void pickTemplates(const string_t *input, const char **templates,
+                          size_t count, size_t k, bool *picked) {
+  float scores[TEMPLATE_SHOTS] = {};
+  for (size_t i = 0; i < count; i++) {
+    picked[i] = k == 0;
+    scores[i] = intentSimilarity(input->data, templates[i]);
+  }
+
+  for (size_t n = 0; n < k && n < count; n++) {
+    size_t best = 0;
+    while (picked[best]) {
+      best++;
+    }
+    for (size_t i = best + 1; i < count; i++) {
+      if (!picked[i] && scores[i] > scores[best]) {
+        best = i;
+      }
     }
+    picked[best] = true;
   }
 }
 
-void parserExtractTarget(parser_t *self, const string_t *input,
-                         const locations_t *locations, const items_t *items,
-                         location_t **result_location, item_t **result_item) {
+// Resolves the target among the given ones, using the given model and prompt
+// buffer for what cannot be matched without them
+static void extractTarget(parser_t *self, ai_t *ai, tokens_t *prompt,
+                          const string_t *input, const locations_t *locations,
+                          const items_t *items, location_t **result_location,
+                          item_t **result_item) {
   panicif(!locations, "missing locations");
   panicif(!items, "missing items");
   panicif(!input, "missing input");
 
-  const config_t *config = self->ai->configuration;
-  const string_t *sys_prompt_tpl = config->prompt_templates[PROMPT_TYPE_SYS];
-  const string_t *usr_prompt_tpl = config->prompt_templates[PROMPT_TYPE_USR];
-  const string_t *res_prompt_tpl = config->prompt_templates[PROMPT_TYPE_RES];
+  int match = -1;
+  if (!self->model_only) {
+    match = matchName(input, locations, items);
+  }
+  if (match < 0 && !self->model_only) {
+    match = fuzzyMatchName(self, input, locations, items);
+  }
+  if (match < 0 && !self->model_only) {
+    match = embeddingMatchName(self, ai, input, locations, items);
+  }
+  if (match >= 0) {
+    const size_t index = (size_t)match;
+    *result_location =
+        index < locations->len ? bufAt(locations, index) : NULL;
+    *result_item =
+        index < locations->len ? NULL : bufAt(items, index - locations->len);
+    debug("matched name: %s", index < locations->len
+                                   ? (*result_location)->object.name
+                                   : (*result_item)->object.name);
+    return;
+  }
 
-  strFmt(self->prompt, sys_prompt_tpl->data, PARSER_TARGET_SYS_PROMPT.data);
+  prompt->len = 0;
+  ai_result_t result = aiPromptAppendTokens(prompt, self->target_prompt);
 
-  strFmt(self->target_grammar, "root ::= \"unknown\"");
+  bool location_shots[arrLen(location_shots_tpls)];
+  bool item_shots[arrLen(item_shots_tpls)];
+  pickTemplates(input, location_shots_tpls, arrLen(location_shots_tpls),
+                self->shots / 2, location_shots);
+  pickTemplates(input, item_shots_tpls, arrLen(item_shots_tpls),
+                self->shots / 2, item_shots);
 
   size_t i = 0;
-  bufEach(locations, i) {
-    location_t *exit = bufAt(locations, i);
-    strFmtAppend(self->target_grammar, " | \"%s\"", exit->object.name);
-  }
-
-  bufEach(items, i) {
-    item_t *item = bufAt(items, i);
-    strFmtAppend(self->target_grammar, " | \"%s\"", item->object.name);
-  }
-
   char shot_buffer[256] = {};
   if (locations->len) {
-    for (i = 0; i < arrLen(location_shots_tpls); i++) {
+    for (i = 0; i < arrLen(location_shots_tpls) && result == AI_RESULT_OK;
+         i++) {
+      if (!location_shots[i])
+        continue;
       const char *shot_tpl = location_shots_tpls[i];
       const size_t j = i % locations->len;
       location_t *exit = (location_t *)bufAt(locations, j);
       snprintf(shot_buffer, sizeof(shot_buffer), shot_tpl, exit->object.name);
-      strFmtAppend(self->prompt, usr_prompt_tpl->data, shot_buffer);
-      strFmtAppend(self->prompt, res_prompt_tpl->data, exit->object.name);
+      result = appendShot(ai, prompt, shot_buffer, exit->object.name);
     }
   }
 
   if (items->len) {
-    for (i = 0; i < arrLen(item_shots_tpls); i++) {
+    for (i = 0; i < arrLen(item_shots_tpls) && result == AI_RESULT_OK; i++) {
+      if (!item_shots[i])
+        continue;
       const char *shot_tpl = item_shots_tpls[i];
       const size_t j = i % items->len;
       const item_t *item = bufAt(items, j);
       snprintf(shot_buffer, sizeof(shot_buffer), shot_tpl, item->object.name);
-      strFmtAppend(self->prompt, usr_prompt_tpl->data, shot_buffer);
-      strFmtAppend(self->prompt, res_prompt_tpl->data, item->object.name);
+      result = appendShot(ai, prompt, shot_buffer, item->object.name);
     }
   }
 
-  strFmtAppend(self->prompt, usr_prompt_tpl->data, input->data);
-  strFmtAppend(self->prompt, res_prompt_tpl->data, "");
+  if (result == AI_RESULT_OK) {
+    result = appendShot(ai, prompt, input->data, "");
+  }
+  panicif(result != AI_RESULT_OK, "cannot tokenize prompt");
 
-  ai_result_t result = aiSetGrammar(self->ai, self->target_grammar);
-  panicif(result != AI_RESULT_OK, "cannot set grammar");
-  strClear(self->response);
-  result = aiGenerate(self->ai, self->prompt, self->response);
-  panicif(result != AI_RESULT_OK, "cannot generate response");
-  strTrim(self->response);
+  // Every name is scored at once, however long, along with "unknown"
+  const size_t count = locations->len + items->len;
+  const char **labels = allocate(sizeof(const char *) * (count + 1));
+  panicif(!labels, "cannot allocate labels");
+  labels[0] = "unknown";
+  for (i = 0; i < count; i++) {
+    labels[i + 1] = i < locations->len
+                        ? bufAt(locations, i)->object.name
+                        : bufAt(items, i - locations->len)->object.name;
+  }
 
-  bufEach(locations, i) {
-    location_t *location = bufAt(locations, i);
-    if (objectNameEq(self->response->data, location->object.name)) {
-      debug("found location: %s", location->object.name);
-      *result_item = NULL;
-      *result_location = location;
-      return;
+  size_t best = 0;
+  float confidence = 0;
+  result = aiRank(ai, prompt, labels, count + 1, &best, &confidence);
+  debug("ranked target: %s (%.2f)", labels[best], (double)confidence);
+  deallocate(&labels);
+
+  // Targets that cannot be ranked are not understood, like unknown ones
+  *result_item = NULL;
+  *result_location = NULL;
+  if (result != AI_RESULT_OK) {
+    error("cannot rank targets: %d", result);
+    return;
+  }
+  if (best == 0 || confidence < TARGET_CONFIDENCE) {
+    return;
+  }
+
+  const size_t index = best - 1;
+  if (index < locations->len) {
+    *result_location = bufAt(locations, index);
+  } else {
+    *result_item = bufAt(items, index - locations->len);
+  }
+}
+
+void parserExtractTarget(parser_t *self, const string_t *input,
+                         const locations_t *locations, const items_t *items,
+                         location_t **result_location, item_t **result_item) {
+  typingPause(self);
+  extractTarget(self, self->ai, self->prompt, input, locations, items,
+                result_location, result_item);
+}
+
+// Collects the objects the action applies to in the current location
+static void collectTargets(const world_t *world, action_type_t action,
+                           locations_t *locations, items_t *items) {
+  bufClear(locations, NULL);
+  bufClear(items, NULL);
+
+  if (action == ACTION_TYPE_MOVE) {
+    bufCat(locations, world->location->exits);
+  } else if (action == ACTION_TYPE_EXAMINE) {
+    bufCat(locations, world->location->exits);
+    bufCat(items, world->location->items);
+    bufCat(items, world->inventory);
+  } else if (action == ACTION_TYPE_TAKE) {
+    bufCat(items, world->location->items);
+  } else if (action == ACTION_TYPE_DROP) {
+    bufCat(items, world->inventory);
+  } else if (action == ACTION_TYPE_USE) {
+    bufCat(items, world->inventory);
+    bufCat(items, world->location->items);
+  }
+}
+
+// Lists the verb followed by each name, except the one of the excluded item
+static void formatChoices(string_t *choices, const char *verb,
+                          const locations_t *locations, const items_t *items,
+                          const item_t *excluded) {
+  size_t i = 0;
+  if (locations) {
+    bufEach(locations, i) {
+      strFmtAppend(choices, "\n%s %s", verb, bufAt(locations, i)->object.name);
+    }
+  }
+
+  if (items) {
+    bufEach(items, i) {
+      const item_t *item = bufAt(items, i);
+      if (item != excluded) {
+        strFmtAppend(choices, "\n%s %s", verb, item->object.name);
+      }
+    }
+  }
+}
+
+// Every command that applies to something: each verb followed by the names of
+// the objects it applies to, one per line. Returns false if they do not fit.
+static bool formatCommandChoices(string_t *choices, const world_t *world) {
+  const location_t *location = world->location;
+  strFmt(choices, "unknown");
+  formatChoices(choices, "move", location->exits, NULL, NULL);
+  formatChoices(choices, "examine", location->exits, location->items, NULL);
+  formatChoices(choices, "examine", NULL, world->inventory, NULL);
+  formatChoices(choices, "take", NULL, location->items, NULL);
+  formatChoices(choices, "drop", NULL, world->inventory, NULL);
+
+  const items_t *visible[] = {location->items, world->inventory};
+  char verb[OBJECT_NAME_NORMALIZED_LENGTH + 8];
+  for (size_t v = 0; v < arrLen(visible); v++) {
+    size_t i = 0;
+    bufEach(visible[v], i) {
+      const item_t *item = bufAt(visible[v], i);
+      strFmtAppend(choices, "\nuse %s", item->object.name);
+      snprintf(verb, sizeof(verb), "use %s on", item->object.name);
+      for (size_t w = 0; w < arrLen(visible); w++) {
+        formatChoices(choices, verb, NULL, visible[w], item);
+      }
     }
   }
 
+  // Truncated choices would end with part of a name
+  return choices->len < choices->cap;
+}
+
+// Returns the text following the name, if the text starts with it
+static const char *skipName(const char *text, const char *name) {
+  const size_t len = strlen(name);
+  if (strncmp(text, name, len) != 0) {
+    return NULL;
+  }
+  return text[len] == ' ' || text[len] == '\0' ? text + len : NULL;
+}
+
+// Finds the item whose name starts the text, preferring the longest name.
+// Rest is set to the text following it.
+static item_t *readItem(const items_t *items, const char *text,
+                        const char **rest) {
+  item_t *result = NULL;
+  size_t i = 0;
   bufEach(items, i) {
     item_t *item = bufAt(items, i);
-    if (objectNameEq(self->response->data, item->object.name)) {
-      debug("found item: %s", item->object.name);
-      *result_item = item;
-      *result_location = NULL;
+    const char *after = skipName(text, item->object.name);
+    if (after && (!result || after > *rest)) {
+      result = item;
+      *rest = after;
+    }
+  }
+  return result;
+}
+
+// Reads the operation from one of the command choices
+static void readCommand(parser_t *self, const world_t *world,
+                        const string_t *response, operation_t *operation) {
+  operation->as.action = ACTION_TYPE_UNKNOWN;
+
+  const char *text = NULL;
+  size_t i = 0;
+  for (i = 0; i < ACTION_TYPES && !text; i++) {
+    text = skipName(response->data, action_names[i]->data);
+    if (text) {
+      operation->as.action = actions_types[i];
+    }
+  }
+  if (!text || *text != ' ') {
+    return;
+  }
+  text++;
+
+  collectTargets(world, operation->as.action, self->locations, self->items);
+  bufEach(self->locations, i) {
+    location_t *location = bufAt(self->locations, i);
+    if (objectNameEq(location->object.name, text)) {
+      operation->location = location;
       return;
     }
   }
 
-  *result_item = NULL;
-  *result_location = NULL;
+  const char *rest = text;
+  operation->item = readItem(self->items, text, &rest);
+  if (!operation->item || operation->as.action != ACTION_TYPE_USE) {
+    return;
+  }
+
+  rest = skipName(rest, " on");
+  if (rest && *rest == ' ') {
+    const char *end = NULL;
+    operation->indirect = readItem(self->items, rest + 1, &end);
+  }
+}
+
+// Decodes the beginning of the prompt the model would be given for the text,
+// whenever it changes. Errors are ignored: the parse will just decode more.
+static void *typingLoop(void *data) {
+  parser_t *self = data;
+  typing_t *typing = self->typing;
+  char text[OBJECT_NAME_NORMALIZED_LENGTH];
+
+  pthread_mutex_lock(&typing->lock);
+  while (true) {
+    while (!typing->pending && !typing->quit) {
+      pthread_cond_wait(&typing->signal, &typing->lock);
+    }
+    if (typing->quit) {
+      break;
+    }
+    snprintf(text, sizeof(text), "%s", typing->text->data);
+    typing->pending = 0;
+    typing->busy = 1;
+    pthread_mutex_unlock(&typing->lock);
+
+    tokens_t *prompt = typing->prompt;
+    prompt->len = 0;
+    ai_result_t result = aiPromptAppendTokens(prompt, self->command_prompt);
+    if (result == AI_RESULT_OK) {
+      result = aiPromptAppendOpen(self->ai, prompt, PROMPT_TYPE_USR, text);
+    }
+    if (result == AI_RESULT_OK) {
+      result = aiPrefill(self->ai, prompt);
+    }
+    debug("decoded while typing: %s (%d)", text, result);
+
+    pthread_mutex_lock(&typing->lock);
+    typing->busy = 0;
+    pthread_cond_broadcast(&typing->signal);
+  }
+  pthread_mutex_unlock(&typing->lock);
+  return NULL;
+}
+
+static void typingDestroy(typing_t **self) {
+  if (!self || !*self)
+    return;
+
+  strDestroy(&(*self)->text);
+  aiPromptDestroy(&(*self)->prompt);
+  deallocate(self);
+}
+
+void parserTypingStart(parser_t *self) {
+  if (self->typing) {
+    return;
+  }
+
+  typing_t *typing = allocate(sizeof(typing_t));
+  panicif(!typing, "cannot allocate typing state");
+  typing->text = strCreate(OBJECT_NAME_NORMALIZED_LENGTH);
+  panicif(!typing->text, "cannot allocate typing buffer");
+  typing->prompt = aiPromptCreate(self->ai);
+  panicif(!typing->prompt, "cannot allocate prompt buffer");
+  pthread_mutex_init(&typing->lock, NULL);
+  pthread_cond_init(&typing->signal, NULL);
+
+  self->typing = typing;
+  if (pthread_create(&typing->tid, NULL, typingLoop, self) != 0) {
+    // Typing goes on as usual, only without anything decoded meanwhile
+    self->typing = NULL;
+    typingDestroy(&typing);
+  }
+}
+
+void parserTyping(parser_t *self, const char *input) {
+  typing_t *typing = self->typing;
+  if (!typing || input[0] == '/') {
+    return;
+  }
+
+  size_t len = 0;
+  const char *space = strrchr(input, ' ');
+  if (space) {
+    len = (size_t)(space - input);
+  }
+  while (len > 0 && input[len - 1] == ' ') {
+    len--;
+  }
+  if (len == 0 || len >= typing->text->cap) {
+    return;
+  }
+
+  pthread_mutex_lock(&typing->lock);
+  if (typing->text->len != len ||
+      strncmp(typing->text->data, input, len) != 0) {
+    strFmt(typing->text, "%.*s", (int)len, input);
+    typing->pending = 1;
+    pthread_cond_signal(&typing->signal);
+  }
+  pthread_mutex_unlock(&typing->lock);
+}
+
+// Stops the background decoding for good
+static void typingStop(parser_t *self) {
+  typing_t *typing = self->typing;
+  if (!typing) {
+    return;
+  }
+
+  pthread_mutex_lock(&typing->lock);
+  typing->quit = 1;
+  pthread_cond_signal(&typing->signal);
+  pthread_mutex_unlock(&typing->lock);
+  pthread_join(typing->tid, NULL);
+
+  pthread_mutex_destroy(&typing->lock);
+  pthread_cond_destroy(&typing->signal);
+  typingDestroy(&self->typing);
+}
+
+typedef struct {
+  parser_t *parser;
+  const string_t *input;
+  location_t *location;
+  item_t *item;
+} target_job_t;
+
+static void *extractTargetJob(void *data) {
+  target_job_t *job = data;
+  parser_t *self = job->parser;
+  extractTarget(self, self->worker, self->worker_prompt, job->input,
+                self->locations, self->items, &job->location, &job->item);
+  return NULL;
+}
+
+// Classifies the action while the target is extracted on the second context,
+// among everything any action may apply to. Once the action is known, the
+// target is dropped if the action does not apply to it.
+static void parseConcurrently(parser_t *self, const world_t *world,
+                              const string_t *input, operation_t *operation) {
+  if (!self->worker) {
+    ai_result_t result;
+    self->worker = aiCreate(&PARSER_CONFIG, &result);
+    panicif(!self->worker, "cannot allocate AI for parser");
+    self->worker_prompt = aiPromptCreate(self->worker);
+    panicif(!self->worker_prompt, "cannot allocate prompt buffer");
+  }
+
+  // Examining applies to exits, items in the room, and items carried
+  collectTargets(world, ACTION_TYPE_EXAMINE, self->locations, self->items);
+  target_job_t job = {self, input, NULL, NULL};
+  pthread_t tid;
+  const int started = pthread_create(&tid, NULL, extractTargetJob, &job) == 0;
+
+  operation->as.action = classifyAction(self, self->ai, self->prompt, input);
+
+  if (started) {
+    pthread_join(tid, NULL);
+  } else {
+    extractTargetJob(&job);
+  }
+
+  collectTargets(world, operation->as.action, self->locations, self->items);
+  if (job.location &&
+      locationsFindByName(self->locations, job.location->object.name) >= 0) {
+    operation->location = job.location;
+  }
+  if (job.item && itemsFind(self->items, job.item) >= 0) {
+    operation->item = job.item;
+  }
+}
+
+// Classifies the action, then extracts its target among the objects it
+// applies to
+static void parseInSteps(parser_t *self, const world_t *world,
+                         const string_t *input, operation_t *operation) {
+  operation->as.action = classifyAction(self, self->ai, self->prompt, input);
+  collectTargets(world, operation->as.action, self->locations, self->items);
+  parserExtractTarget(self, input, self->locations, self->items,
+                      &operation->location, &operation->item);
+}
+
+void parserParse(parser_t *self, const world_t *world, const string_t *input,
+                 operation_t *operation) {
+  panicif(!self->items || !self->locations, "parser is not prepared");
+  typingPause(self);
+  operation->location = NULL;
+  operation->item = NULL;
+  operation->indirect = NULL;
+
+  if (bufAt(input, 0) == '/') {
+    parserGetOperation(self, operation, input);
+    return;
+  }
+
+  operation->type = OPERATION_TYPE_ACTION;
+  operation->as.action = guessAction(self, input);
+  if (operation->as.action != ACTION_TYPE_UNKNOWN) {
+    collectTargets(world, operation->as.action, self->locations, self->items);
+    parserExtractTarget(self, input, self->locations, self->items,
+                        &operation->location, &operation->item);
+    return;
+  }
+
+  self->prompt->len = 0;
+  ai_result_t result =
+      aiPromptAppendTokens(self->prompt, self->command_prompt);
+  if (result == AI_RESULT_OK) {
+    result = appendShot(self->ai, self->prompt, input->data, "");
+  }
+  panicif(result != AI_RESULT_OK, "cannot tokenize prompt");
+
+  // Too many objects around for a single generation
+  if (!formatCommandChoices(self->command_choices, world) ||
+      aiSetChoices(self->ai, self->command_choices) != AI_RESULT_OK) {
+    debug("command choices do not fit: parsing in steps");
+    if (self->concurrent) {
+      parseConcurrently(self, world, input, operation);
+    } else {
+      parseInSteps(self, world, input, operation);
+    }
+    return;
+  }
+  strClear(self->response);
+  result = aiGenerate(self->ai, self->prompt, self->response);
+  panicif(result != AI_RESULT_OK, "cannot generate response");
+  strTrim(self->response);
+
+  debug("parsed command: %s", self->response->data);
+  readCommand(self, world, self->response, operation);
 }
 
 void parserDestroy(parser_t **self) {
   if (!self || !*self)
     return;
 
+  typingStop(*self);
+  aiPromptDestroy(&(*self)->prompt);
+  aiPromptDestroy(&(*self)->action_system);
+  aiPromptDestroy(&(*self)->action_prompt);
+  aiPromptDestroy(&(*self)->target_prompt);
+  aiPromptDestroy(&(*self)->command_prompt);
   aiDestroy(&(*self)->ai);
-  strDestroy(&(*self)->prompt);
+  aiPromptDestroy(&(*self)->worker_prompt);
+  aiDestroy(&(*self)->worker);
+  intentDestroy(&(*self)->intent);
   strDestroy(&(*self)->response);
-  strDestroy(&(*self)->target_grammar);
+  strDestroy(&(*self)->command_choices);
+  locationsDestroy(&(*self)->locations);
+  itemsDestroy(&(*self)->items);
+  bktreeMatchesDestroy(&(*self)->matches);
+  deallocate(&(*self)->embeddings);
+  deallocate(&(*self)->centroid);
+  deallocate(&(*self)->query);
+  deallocate(&(*self)->embedded);
   deallocate(self);
 }
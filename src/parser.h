@@ -1,21 +1,105 @@
 #pragma once
 
 #include "ai.h"
+#include "intent.h"
+#include "lib/bktree.h"
 #include "lib/buffers.h"
 #include "world/action.h"
 #include "world/command.h"
 #include "world/item.h"
 #include "world/location.h"
+#include "world/world.h"
 
+#include <pthread.h>
 #include <stddef.h>
 
+// Rows of the embedding matrix holding an object, one per state description
+typedef struct {
+  const object_t *object;
+  size_t row;
+  size_t states;
+} embedded_t;
+
+typedef Buffer(embedded_t) embedded_objects_t;
+
+// Decodes the input in the background while it is typed
+typedef struct {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t signal;
+  // Completed words of the input typed so far
+  string_t *text;
+  // Whether the text changed since it was last decoded
+  int pending;
+  // Whether the model is decoding it, and cannot be used for anything else
+  int busy;
+  int quit;
+  tokens_t *prompt;
+} typing_t;
+
 typedef struct {
   ai_t *ai;
-  string_t *prompt;
+  // Tells the action without the model, when it is confident enough
+  intent_t *intent;
+  // Skips everything but the model, to compare it with the rest
+  int model_only;
+  // When the command choices do not fit, extracts the target on a second
+  // context of the same model while the action is classified, instead of
+  // one after the other. Otherwise both come from a single generation.
+  int concurrent;
+  ai_t *worker;
+  tokens_t *worker_prompt;
+  tokens_t *prompt;
+  // How many of the examples most similar to the input are shown to the model
+  // as shots. Without, the fixed set of shots is shown.
+  size_t shots;
+  // System prompt of the action prompt, which the shots picked follow
+  tokens_t *action_system;
+  // Tokenized once, these start every action and target prompt respectively
+  tokens_t *action_prompt;
+  tokens_t *target_prompt;
+  tokens_t *command_prompt;
   string_t *response;
-  string_t *target_grammar;
+  string_t *command_choices;
+  // Targets the current action applies to
+  locations_t *locations;
+  items_t *items;
+  // Words of all the names in the world, to resolve targets despite typos.
+  // Owned by the world.
+  const bktree_t *names;
+  bktree_matches_t *matches;
+  // Embeddings of the name of every object in the world along with each of
+  // its state descriptions, row after row. Built by parserPrepare.
+  float *embeddings;
+  size_t embedding_size;
+  embedded_objects_t *embedded;
+  // Mean of the rows, scaled to unit length. Mean-pooled embeddings are all
+  // alike: a target is only trusted if it is more similar than this.
+  float *centroid;
+  // Embedding of the current input
+  float *query;
+  // Only set once parserTypingStart succeeds
+  typing_t *typing;
 } parser_t;
 
+// Below this, the intent classifier is not trusted and the model is asked
+#define INTENT_CONFIDENCE 0.9f
+
+// Below this, the most likely target is not trusted and none is returned
+#define TARGET_CONFIDENCE 0.5f
+
+// Below this cosine similarity, or closer than the margin to the runner-up or
+// to the centroid of all the objects, the target most similar to the input is
+// not trusted and the model is asked
+#define TARGET_SIMILARITY 0.75f
+#define TARGET_SIMILARITY_MARGIN 0.05f
+
+// Shots picked by default for each prompt
+#define PARSER_SHOTS 6
+
+// Most words of the world names considered for each input
+#define PARSER_MATCHES 64
+
 typedef enum {
   OPERATION_TYPE_ACTION,
   OPERATION_TYPE_COMMAND,
@@ -29,13 +113,37 @@ typedef struct {
     action_type_t action;
     command_type_t command;
   } as;
+  // Target of the action, resolved by parserParse only
+  location_t *location;
+  item_t *item;
+  // What the item is used on, as in "use shears on vines". Optional.
+  item_t *indirect;
 } operation_t;
 
 parser_t *parserCreate(void);
 
+// Looks up targets among the world names, embeds them, and allocates what
+// parserParse needs
+void parserPrepare(parser_t *, const world_t *);
+
 void parserGetOperation(parser_t*, operation_t*, const string_t*);
 
+// Resolves both the operation and its target, among the objects the action
+// applies to in the current location. The model is asked at most once: for
+// both at the same time, or for whichever could not be told without it.
+void parserParse(parser_t *, const world_t *, const string_t *, operation_t *);
+
 void parserExtractTarget(parser_t *, const string_t *, const locations_t *,
                          const items_t *, location_t **, item_t **);
 
+// Starts decoding the input in the background while it is typed: whatever
+// input parserTyping reports is decoded as the beginning of the prompt of the
+// model, so that only its end is left to decode when it is parsed. Every
+// function using the model waits for it to stop decoding first.
+void parserTypingStart(parser_t *);
+// Reports the input typed so far. Only completed words are decoded, since the
+// tokens of the last word may change as it is typed. Backspaces are followed
+// by dropping what no longer matches from the KV cache.
+void parserTyping(parser_t *, const char *);
+
 void parserDestroy(parser_t **self);
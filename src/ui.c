@@ -50,21 +50,52 @@ void uiLoadingStop(ui_handle_t **handle) {
   deallocate(handle);
 }
 
-static void printResponse(string_t *response, const char *prefix) {
-  const char *s = response->data;
-  size_t col = 0;
-  size_t prefix_len = strlen(prefix);
+typedef struct {
+  const char *prefix;
+  size_t prefix_len;
+  size_t col;
+} cursor_t;
+
+static void cursorStart(cursor_t *cursor, const char *prefix) {
+  cursor->prefix = prefix;
+  cursor->prefix_len = strlen(prefix);
 
   // Always start with prefix
-  fwrite(prefix, 1, prefix_len, stdout);
-  col = prefix_len;
+  fwrite(prefix, 1, cursor->prefix_len, stdout);
+  cursor->col = cursor->prefix_len;
+}
+
+static void cursorNewLine(cursor_t *cursor) {
+  fwrite(ESC_RESET, 1, sizeof(ESC_RESET), stdout);
+  putchar('\n');
+  fwrite(cursor->prefix, 1, cursor->prefix_len, stdout);
+  cursor->col = cursor->prefix_len;
+}
+
+static void cursorPrintWord(cursor_t *cursor, const char *word, size_t len) {
+  // If the word doesn't fit, break line
+  if (cursor->col > cursor->prefix_len &&
+      cursor->col + len > (size_t)SCREEN_WIDTH) {
+    cursorNewLine(cursor);
+  }
+  fwrite(word, 1, len, stdout);
+  cursor->col += len;
+}
+
+static void cursorEnd(cursor_t *cursor) {
+  (void)cursor;
+  fwrite(ESC_RESET, 1, sizeof(ESC_RESET), stdout);
+  putchar('\n');
+}
+
+static void printResponse(string_t *response, const char *prefix) {
+  const char *s = response->data;
+  cursor_t cursor;
+  cursorStart(&cursor, prefix);
 
   while (*s) {
     if (*s == '\n') {
-      fwrite(ESC_RESET, 1, sizeof(ESC_RESET), stdout);
-      putchar('\n');
-      fwrite(prefix, 1, prefix_len, stdout);
-      col = prefix_len;
+      cursorNewLine(&cursor);
       s++;
       continue;
     }
@@ -72,27 +103,94 @@ static void printResponse(string_t *response, const char *prefix) {
     const char *word = s;
     while (*word && *word != ' ' && *word != '\n')
       word++;
-    size_t word_len = (size_t)(word - s);
-    // If the word doesn't fit, break line
-    if (col > prefix_len && col + word_len > SCREEN_WIDTH) {
-      fwrite(ESC_RESET, 1, sizeof(ESC_RESET), stdout);
-      putchar('\n');
-      fwrite(prefix, 1, prefix_len, stdout);
-      col = prefix_len;
-    }
-    // Print the word
-    fwrite(s, 1, word_len, stdout);
-    col += word_len;
+    cursorPrintWord(&cursor, s, (size_t)(word - s));
     s = word;
     // Print the space if present
     if (*s == ' ') {
       putchar(' ');
-      col++;
+      cursor.col++;
       s++;
     }
   }
-  fwrite(ESC_RESET, 1, sizeof(ESC_RESET), stdout);
-  putchar('\n');
+  cursorEnd(&cursor);
+}
+
+static void *streaming(void *args) {
+  ui_stream_t *stream = (ui_stream_t *)args;
+  cursor_t cursor;
+  cursorStart(&cursor, " |  ");
+
+  // Words are printed only once complete, to know whether they fit the line
+  char word[256];
+  size_t word_len = 0;
+
+  while (1) {
+    // Read stop first: everything written before it was set is then visible
+    const int stop = atomic_load_explicit(&stream->stop, memory_order_acquire);
+    const size_t head =
+        atomic_load_explicit(&stream->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);
+
+    for (; tail != head; tail++) {
+      const char c = stream->queue[tail % UI_STREAM_CAPACITY];
+      if (c == ' ' || c == '\n' || word_len == sizeof(word)) {
+        cursorPrintWord(&cursor, word, word_len);
+        word_len = 0;
+      }
+
+      if (c == '\n') {
+        cursorNewLine(&cursor);
+      } else if (c == ' ') {
+        putchar(' ');
+        cursor.col++;
+      } else {
+        word[word_len++] = c;
+      }
+    }
+    atomic_store_explicit(&stream->tail, tail, memory_order_release);
+    fflush(stdout);
+
+    if (stop)
+      break;
+    sleep_ms(10);
+  }
+
+  cursorPrintWord(&cursor, word, word_len);
+  cursorEnd(&cursor);
+  fflush(stdout);
+  return NULL;
+}
+
+ui_stream_t *uiStreamStart(void) {
+  ui_stream_t *stream = allocate(sizeof(ui_stream_t));
+  panicif(!stream, "cannot allocate stream");
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, streaming, stream);
+  stream->tid = tid;
+  return stream;
+}
+
+void uiStreamWrite(ui_stream_t *stream, const string_t *text) {
+  size_t head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+  for (size_t i = 0; i < text->len; i++) {
+    // Wait for the printing thread to make room
+    while (head - atomic_load_explicit(&stream->tail, memory_order_acquire) ==
+           UI_STREAM_CAPACITY) {
+      sleep_ms(1);
+    }
+    stream->queue[head % UI_STREAM_CAPACITY] = bufAt(text, i);
+    head++;
+    atomic_store_explicit(&stream->head, head, memory_order_release);
+  }
+}
+
+void uiStreamStop(ui_stream_t **stream) {
+  if (!stream || !(*stream))
+    return;
+  atomic_store_explicit(&(*stream)->stop, 1, memory_order_release);
+  pthread_join((*stream)->tid, NULL);
+  deallocate(stream);
 }
 
 // Get visible string length, removing control sequences
@@ -12,6 +12,23 @@ typedef struct {
 ui_handle_t *uiLoadingStart(void);
 void uiLoadingStop(ui_handle_t **);
 
+#define UI_STREAM_CAPACITY 4096
+
+// Prints a description while it's being written. Text is handed over to the
+// printing thread through a lock-free single-producer/single-consumer queue.
+typedef struct {
+  pthread_t tid;
+  atomic_int stop;
+  atomic_size_t head;
+  atomic_size_t tail;
+  char queue[UI_STREAM_CAPACITY];
+} ui_stream_t;
+
+ui_stream_t *uiStreamStart(void);
+void uiStreamWrite(ui_stream_t *, const string_t *);
+// Prints what is left in the queue and terminates the description
+void uiStreamStop(ui_stream_t **);
+
 void uiClearScreen(void);
 
 typedef void (*print_string_callback_t)(string_t *);
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "../lib/bktree.h"
 #include "../lib/buffers.h"
 #include "action.h"
+#include <ctype.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -27,6 +29,31 @@ static inline int objectNameEq(object_name_t self, const_object_name_t other) {
   return strcmp(self, other) == 0;
 }
 
+#define OBJECT_NAME_NORMALIZED_LENGTH 256
+
+// Lowercases the text and turns everything but letters and digits into single
+// spaces, so that "Take the KEY!" becomes "take the key". Names and player
+// input are compared in this form.
+static inline void objectNameNormalize(const char *text, char *result) {
+  size_t len = 0;
+  for (const char *c = text;
+       *c && len < OBJECT_NAME_NORMALIZED_LENGTH - 1; c++) {
+    if (isalnum((unsigned char)*c)) {
+      result[len++] = (char)tolower((unsigned char)*c);
+    } else if (len > 0 && result[len - 1] != ' ') {
+      result[len++] = ' ';
+    }
+  }
+
+  if (len > 0 && result[len - 1] == ' ') {
+    len--;
+  }
+  result[len] = '\0';
+}
+
+// Words shorter than this are too ambiguous to be looked up despite typos
+#define OBJECT_NAME_MIN_WORD 3
+
 // A number representing the state of a given object
 // States are described in descriptions_t such that the n-th description
 // corresponds to the state n.
@@ -63,6 +90,8 @@ typedef struct {
   descriptions_t *descriptions;
   // Transitions from one state to the next
   transitions_t *transitions;
+  // Bumped whenever the object changes: its state, or what it contains
+  uint32_t version;
 } object_t;
 
 typedef enum {
@@ -107,6 +136,25 @@ static inline void objectDestroyInner(object_t **self) {
   }
 }
 
+// Adds the words of the object name to the index, pointing to the object
+__attribute__((warn_unused_result)) static inline bktree_result_t
+objectNameIndex(bktree_t *index, object_t *object) {
+  char name[OBJECT_NAME_NORMALIZED_LENGTH];
+  objectNameNormalize(object->name, name);
+
+  char *state = NULL;
+  for (char *word = strtok_r(name, " ", &state); word;
+       word = strtok_r(NULL, " ", &state)) {
+    if (strlen(word) < OBJECT_NAME_MIN_WORD)
+      continue;
+
+    bktree_result_t result = bktreeAdd(index, word, object);
+    if (result != BKTREE_RESULT_OK)
+      return result;
+  }
+  return BKTREE_RESULT_OK;
+}
+
 struct requirement_tuple_t {
   object_name_t name;
   object_state_t state;
@@ -43,6 +43,7 @@ void worldDestroy(world_t **self) {
     endingsDestroy(&world->endings);
   }
 
+  bktreeDestroy(&world->names);
   setDestroy(&world->discovered_items);
   setDestroy(&world->discovered_locations);
   setDestroy(&world->solved_puzzles);
@@ -146,6 +147,15 @@ transition_result_t
 worldExecuteTransition(const world_t *self, const object_t *object,
                        action_type_t action, object_t **affected,
                        object_state_t *affected_initial_state) {
+  return worldExecuteTransitionOn(self, object, NULL, action, affected,
+                                  affected_initial_state);
+}
+
+transition_result_t
+worldExecuteTransitionOn(const world_t *self, const object_t *object,
+                         const object_t *target, action_type_t action,
+                         object_t **affected,
+                         object_state_t *affected_initial_state) {
   if (!object->transitions) {
     return TRANSITION_RESULT_OK;
   }
@@ -159,6 +169,8 @@ worldExecuteTransition(const world_t *self, const object_t *object,
 
     object_t *target_object = findObjectByName(self, transition.target->name);
     object_state_t target_state = transition.target->state;
+    if (target && target_object != target)
+      continue;
 
     if (transition.action == action &&
         target_object->state == transition.from) {
@@ -192,6 +204,7 @@ worldExecuteTransition(const world_t *self, const object_t *object,
         }
 
         target_object->state = transition.to;
+        target_object->version++;
         return TRANSITION_RESULT_OK;
       }
       }
@@ -201,6 +214,18 @@ worldExecuteTransition(const world_t *self, const object_t *object,
   return TRANSITION_RESULT_NO_TRANSITION;
 }
 
+void worldTakeItem(world_t *self, item_t *item) {
+  bufPush(self->inventory, item);
+  bufRemove(self->location->items, item, NULL);
+  self->location->object.version++;
+}
+
+void worldDropItem(world_t *self, item_t *item) {
+  bufPush(self->location->items, item);
+  bufRemove(self->inventory, item, NULL);
+  self->location->object.version++;
+}
+
 void worldDigest(world_t *self, game_state_t *result) {
   // Update score
   (void)setAdd(self->discovered_locations, self->location->object.name);
@@ -691,6 +716,30 @@ static void parseMetaFromJSONVal(yyjson_val *raw, meta_t *meta) {
   meta->title = strdup(title_str);
 }
 
+static bktree_t *worldNamesCreate(const world_t *world) {
+  bktree_t *names = bktreeCreate();
+  if (!names)
+    return NULL;
+
+  bktree_result_t result = BKTREE_RESULT_OK;
+  size_t i = 0;
+  bufEach(world->items, i) {
+    item_t *item = bufAt(world->items, i);
+    if (result == BKTREE_RESULT_OK)
+      result = objectNameIndex(names, &item->object);
+  }
+
+  bufEach(world->locations, i) {
+    location_t *location = bufAt(world->locations, i);
+    if (result == BKTREE_RESULT_OK)
+      result = objectNameIndex(names, &location->object);
+  }
+
+  if (result != BKTREE_RESULT_OK)
+    bktreeDestroy(&names);
+  return names;
+}
+
 static world_t *worldFromJSONDoc(yyjson_doc *doc) {
   yyjson_val *root = yyjson_doc_get_root(doc);
   world_t *world = allocate(sizeof(world_t));
@@ -730,6 +779,13 @@ static world_t *worldFromJSONDoc(yyjson_doc *doc) {
     return NULL;
   }
 
+  world->names = worldNamesCreate(world);
+  if (!world->names) {
+    error("cannot index names");
+    worldDestroy(&world);
+    return NULL;
+  }
+
   world->inventory = itemsCreate(world->items->cap);
   world->location = bufAt(world->locations, 0);
   world->end_game = NULL;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "../lib/bktree.h"
 #include "../lib/set.h"
 #include "ending.h"
 #include "item.h"
@@ -45,6 +46,9 @@ struct world_t {
   locations_t *locations;
   // Possible termination states of the story.
   endings_t *endings;
+  // Words of item and location names pointing to their objects, to find them
+  // in the player input despite typos.
+  bktree_t *names;
 
   // Non-owning list of objects carried by the player.
   items_t *inventory;
@@ -86,7 +90,19 @@ transition_result_t worldExecuteTransition(const world_t *, const object_t *,
                                            action_type_t, object_t **,
                                            object_state_t *);
 
+// Like worldExecuteTransition, but only for transitions affecting the target,
+// as in "use shears on vines"
+transition_result_t worldExecuteTransitionOn(const world_t *, const object_t *,
+                                             const object_t *, action_type_t,
+                                             object_t **, object_state_t *);
+
 // Check whether the game is over and returns the game state
 void worldDigest(world_t *, game_state_t *);
 
+// Moves an item from the current location to the inventory
+void worldTakeItem(world_t *, item_t *);
+
+// Moves an item from the inventory to the current location
+void worldDropItem(world_t *, item_t *);
+
 requirements_result_t worldAreRequirementsMet(const world_t *, requirements_t *);
@@ -0,0 +1,97 @@
+#include "../src/lib/archive.h"
+#include "../src/utils.h"
+#include "test.h"
+#include <stdio.h>
+
+static char path[] = "/tmp/ttyny-archive-XXXXXX";
+
+void appendFind(void) {
+  archive_t *archive cleanup(archiveClose) = archiveOpen(path, 1);
+  panicif(!archive, "cannot open archive");
+
+  const char *text = NULL;
+  archive_result_t res = archiveFind(archive, 42, &text);
+  expectEqlu(res, ARCHIVE_ERROR_NOT_FOUND, "empty archive finds nothing");
+
+  res = archiveAppend(archive, 42, "first");
+  expectEqlu(res, ARCHIVE_RESULT_OK, "appends");
+  res = archiveFind(archive, 42, &text);
+  expectEqlu(res, ARCHIVE_RESULT_OK, "finds appended key");
+  expectEqls(text, "first", 6, "finds appended text");
+
+  case("override");
+  (void)archiveAppend(archive, 7, "other");
+  (void)archiveAppend(archive, 42, "second");
+  res = archiveFind(archive, 42, &text);
+  expectEqls(text, "second", 7, "finds the last text of the key");
+  res = archiveFind(archive, 7, &text);
+  expectEqls(text, "other", 6, "finds other keys");
+
+  case("growth");
+  // Enough records to outgrow both the index and the mapping
+  char expected[128];
+  for (archive_key_t key = 1000; key < 3000; key++) {
+    snprintf(expected, sizeof(expected), "text of key %llu, long enough to "
+             "fill the mapping after a couple thousand records",
+             (unsigned long long)key);
+    (void)archiveAppend(archive, key, expected);
+  }
+  size_t found = 0;
+  for (archive_key_t key = 1000; key < 3000; key++) {
+    snprintf(expected, sizeof(expected), "text of key %llu, long enough to "
+             "fill the mapping after a couple thousand records",
+             (unsigned long long)key);
+    found += archiveFind(archive, key, &text) == ARCHIVE_RESULT_OK &&
+             strcmp(text, expected) == 0;
+  }
+  expectEqllu(found, 2000, "finds every key after growing");
+  res = archiveFind(archive, 42, &text);
+  expectEqls(text, "second", 7, "finds keys appended before growing");
+}
+
+void reopen(void) {
+  case("persistence");
+  archive_t *archive = archiveOpen(path, 1);
+  panicif(!archive, "cannot open archive");
+  const char *text = NULL;
+  archive_result_t res = archiveFind(archive, 42, &text);
+  expectEqlu(res, ARCHIVE_RESULT_OK, "finds keys of previous sessions");
+  expectEqls(text, "second", 7, "finds texts of previous sessions");
+  const size_t size = archive->size;
+  archiveClose(&archive);
+
+  case("torn record");
+  // A crash in the middle of an append leaves part of a record behind
+  FILE *file = fopen(path, "ab");
+  panicif(!file, "cannot open archive file");
+  fwrite("\x01\x02\x03\x04\x05\x06\x07\x08\x09", 1, 9, file);
+  fclose(file);
+
+  archive = archiveOpen(path, 1);
+  panicif(!archive, "cannot open archive");
+  expectEqllu(archive->size, size, "drops the torn record");
+  res = archiveAppend(archive, 3, "after");
+  res = archiveFind(archive, 3, &text);
+  expectEqlu(res, ARCHIVE_RESULT_OK, "appends after the valid records");
+  expectEqls(text, "after", 6, "finds text appended after a crash");
+  archiveClose(&archive);
+
+  case("format");
+  archive = archiveOpen(path, 2);
+  panicif(!archive, "cannot open archive");
+  res = archiveFind(archive, 42, &text);
+  expectEqlu(res, ARCHIVE_ERROR_NOT_FOUND, "empties archives of other formats");
+  archiveClose(&archive);
+}
+
+int main(void) {
+  const int fd = mkstemp(path);
+  panicif(fd < 0, "cannot create archive file");
+  close(fd);
+
+  suite(appendFind);
+  suite(reopen);
+
+  unlink(path);
+  return report();
+}
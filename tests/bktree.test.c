@@ -0,0 +1,71 @@
+#include "../src/lib/bktree.h"
+#include "../src/utils.h"
+#include "test.h"
+
+void distance(void) {
+  case("identity");
+  expectEqllu(bktreeDistance("shears", "shears"), 0, "same word");
+  expectEqllu(bktreeDistance("", ""), 0, "empty words");
+
+  case("edits");
+  expectEqllu(bktreeDistance("shers", "shears"), 1, "deletion");
+  expectEqllu(bktreeDistance("shears", "shers"), 1, "insertion");
+  expectEqllu(bktreeDistance("shears", "shoars"), 1, "substitution");
+  expectEqllu(bktreeDistance("shaers", "shears"), 1, "transposition");
+  expectEqllu(bktreeDistance("", "key"), 3, "from empty");
+  expectEqllu(bktreeDistance("garden", "gate"), 3, "many edits");
+}
+
+void search(void) {
+  bktree_t *tree cleanup(bktreeDestroy) = bktreeCreate();
+  panicif(!tree, "cannot create tree");
+  bktree_matches_t *matches cleanup(bktreeMatchesDestroy) =
+      bktreeMatchesCreate(4);
+  panicif(!matches, "cannot create matches");
+
+  int shears = 1, garden = 2, sacred = 3, gate = 4;
+  bktree_result_t res;
+  res = bktreeAdd(tree, "garden", &shears);
+  expectEqlu(res, BKTREE_RESULT_OK, "adds root");
+  res = bktreeAdd(tree, "shears", &shears);
+  panicif(res != BKTREE_RESULT_OK, "add failed");
+  res = bktreeAdd(tree, "sacred", &sacred);
+  panicif(res != BKTREE_RESULT_OK, "add failed");
+  res = bktreeAdd(tree, "garden", &garden);
+  panicif(res != BKTREE_RESULT_OK, "add failed");
+  res = bktreeAdd(tree, "gate", &gate);
+  panicif(res != BKTREE_RESULT_OK, "add failed");
+
+  case("exact");
+  bktreeSearch(tree, "sacred", 0, matches);
+  expectEqllu(matches->len, 1, "finds one match");
+  expectTrue(bufAt(matches, 0).value == &sacred, "finds the value");
+
+  case("typos");
+  matches->len = 0;
+  bktreeSearch(tree, "shers", 1, matches);
+  expectEqllu(matches->len, 1, "finds one match");
+  expectTrue(bufAt(matches, 0).value == &shears, "finds the value");
+  expectEqllu(bufAt(matches, 0).distance, 1, "reports the distance");
+
+  case("duplicates");
+  matches->len = 0;
+  bktreeSearch(tree, "gardn", 1, matches);
+  expectEqllu(matches->len, 2, "finds all the values");
+
+  case("no match");
+  matches->len = 0;
+  bktreeSearch(tree, "lantern", 2, matches);
+  expectEqllu(matches->len, 0, "finds nothing");
+
+  case("full matches");
+  matches->len = 0;
+  bktreeSearch(tree, "garden", 10, matches);
+  expectEqllu(matches->len, matches->cap, "stops when full");
+}
+
+int main(void) {
+  suite(distance);
+  suite(search);
+  return report();
+}
@@ -29,6 +29,21 @@ void validate(void) {
            test_case.input, "Unexpected validation result");
   }
 
+  case("forbidden chars");
+  validate_case_t forbidden_chars[] = {
+      {"you see a lamp (lit)", false},
+      {"you see a [lamp]", false},
+      {"you see a *lamp*", false},
+      {"you see a lamp", true},
+  };
+
+  for (size_t i = 0; i < arrLen(forbidden_chars); i++) {
+    validate_case_t test_case = forbidden_chars[i];
+    strFmt(buffer, "%s", test_case.input);
+    expect(masterIsValidResponse(buffer, required) == test_case.result,
+           test_case.input, "Unexpected validation result");
+  }
+
   case("required words");
   bufPush(required, "you");
   strFmt(buffer, "%s", "you");
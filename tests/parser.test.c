@@ -1,6 +1,8 @@
 #include "../src/parser.h"
 #include "../src/utils.h"
+#include "stat.h"
 #include "test.h"
+#include "timers.h"
 
 void expectEqlAction(int a, int b, const char *msg) {
   char buffer[1024] = {0};
@@ -74,6 +76,12 @@ void actions(void) {
   test("leave the key here", ACTION_TYPE_DROP);
   test("release the coin", ACTION_TYPE_DROP);
   test("abandon the sword", ACTION_TYPE_DROP);
+
+  case("lexicon");
+  test("TAKE the key!", ACTION_TYPE_TAKE);
+  test("please, pick up the coin", ACTION_TYPE_TAKE);
+  test("take a look at the key", ACTION_TYPE_EXAMINE);
+  test("let's go to the hall", ACTION_TYPE_MOVE);
 #undef test
 }
 
@@ -201,14 +209,309 @@ void targets(void) {
   testi("utilize the sword", sword);
   testn("employ the lantern");
   testn("discard the chair");
+
+  case("names");
+  testi("Take the KEY!", key);
+  testl("go to the Hall.", hall);
+
+  bktree_t *names cleanup(bktreeDestroy) = bktreeCreate();
+  panicif(!names, "cannot initialize names");
+  size_t i = 0;
+  bufEach(items, i) {
+    panicif(objectNameIndex(names, &bufAt(items, i)->object),
+            "cannot index item");
+  }
+  bufEach(locations, i) {
+    panicif(objectNameIndex(names, &bufAt(locations, i)->object),
+            "cannot index location");
+  }
+  parser->names = names;
+
+  case("typos");
+  testi("take the kye", key);
+  testi("grab the swrd", sword);
+  testl("go to the kitchne", kitchen);
+  testl("walk into the forrest", forest);
 #undef testl
 #undef testi
 #undef testn
 }
 
+void similar(void) {
+  parser_t *parser cleanup(parserDestroy) = parserCreate();
+  panicif(!parser, "cannot initialize parser");
+
+  string_t *cmd cleanup(strDestroy) = strCreate(128);
+  panicif(!cmd, "cannot initialize command buffer");
+
+  char letter_name[] = "love letter";
+  item_t letter = {.object.name = letter_name};
+  char key_name[] = "key";
+  item_t key = {.object.name = key_name};
+  char lantern_name[] = "lantern";
+  item_t lantern = {.object.name = lantern_name};
+  items_t *all_items cleanup(itemsDestroy) = itemsCreate(3);
+  panicif(!all_items, "cannot initialize items");
+  bufPush(all_items, &letter);
+  bufPush(all_items, &key);
+  bufPush(all_items, &lantern);
+
+  char hall_name[] = "hall";
+  location_t hall = {.object.name = hall_name};
+  locations_t *locations cleanup(locationsDestroy) = locationsCreate(1);
+  panicif(!locations, "cannot initialize locations");
+  bufPush(locations, (struct location_t *)&hall);
+
+  world_t world = {.items = all_items, .locations = locations};
+  // Objects are compared with the input by their embeddings from here on
+  parserPrepare(parser, &world);
+
+  locations_t *exits cleanup(locationsDestroy) = locationsCreate(1);
+  panicif(!exits, "cannot initialize locations");
+  items_t *items cleanup(itemsDestroy) = itemsCreate(3);
+  panicif(!items, "cannot initialize items");
+
+  item_t *item = NULL;
+  location_t *location = NULL;
+#define test(Command, Item)                                                    \
+  item = NULL;                                                                 \
+  location = NULL;                                                             \
+  strFmt(cmd, "%s", Command);                                                  \
+  parserExtractTarget(parser, cmd, exits, items, &location, &item);            \
+  expectTrue(item == Item && !location, Command);
+
+  case("similar names");
+  bufPush(items, &letter);
+  bufPush(items, &key);
+  test("read the letter from my love", &letter);
+  test("look at the letter from my love", &letter);
+
+  case("no similar names");
+  test("drop the sword", NULL);
+
+  case("single target");
+  items->len = 0;
+  bufPush(items, &key);
+  test("drop the sword", NULL);
+  test("light the torch", NULL);
+  test("take the key", &key);
+#undef test
+}
+
+void parse(void) {
+  parser_t *parser cleanup(parserDestroy) = parserCreate();
+  panicif(!parser, "cannot initialize parser");
+
+  string_t *cmd cleanup(strDestroy) = strCreate(128);
+  panicif(!cmd, "cannot initialize command buffer");
+
+  char shears_name[] = "Garden Shears";
+  item_t shears = {.object.name = shears_name};
+  char vines_name[] = "Overgrown Vines";
+  item_t vines = {.object.name = vines_name};
+  char key_name[] = "Key";
+  item_t key = {.object.name = key_name};
+
+  items_t *inventory cleanup(itemsDestroy) = itemsCreate(3);
+  panicif(!inventory, "cannot initialize inventory");
+  bufPush(inventory, &shears);
+  items_t *room_items cleanup(itemsDestroy) = itemsCreate(3);
+  panicif(!room_items, "cannot initialize items");
+  bufPush(room_items, &vines);
+  bufPush(room_items, &key);
+  items_t *all_items cleanup(itemsDestroy) = itemsCreate(3);
+  panicif(!all_items, "cannot initialize items");
+  bufPush(all_items, &shears);
+  bufPush(all_items, &vines);
+  bufPush(all_items, &key);
+
+  char hall_name[] = "Hall";
+  location_t hall = {.object.name = hall_name};
+  char garden_name[] = "Garden";
+  location_t garden = {.object.name = garden_name};
+  locations_t *locations cleanup(locationsDestroy) = locationsCreate(2);
+  panicif(!locations, "cannot initialize locations");
+  bufPush(locations, (struct location_t *)&hall);
+  bufPush(locations, (struct location_t *)&garden);
+  hall.exits = locations;
+  hall.items = room_items;
+  garden.exits = locations;
+  garden.items = room_items;
+
+  world_t world = {.items = all_items,
+                   .locations = locations,
+                   .inventory = inventory,
+                   .location = &hall};
+  parserPrepare(parser, &world);
+
+  operation_t op;
+#define test(Command, Action, Location, Item, Indirect)                        \
+  strFmt(cmd, "%s", Command);                                                  \
+  parserParse(parser, &world, cmd, &op);                                       \
+  expectEqlAction(Action, op.as.action, Command);                              \
+  expectTrue(op.location == Location && op.item == Item &&                     \
+                 op.indirect == Indirect,                                      \
+             Command " (targets)");
+
+  case("without the model");
+  test("take the key", ACTION_TYPE_TAKE, NULL, &key, NULL);
+  test("go to the garden", ACTION_TYPE_MOVE, &garden, NULL, NULL);
+
+  case("single pass");
+  test("cut the vines with the shears", ACTION_TYPE_USE, NULL, &shears,
+       &vines);
+  test("let the shears fall", ACTION_TYPE_DROP, NULL, &shears, NULL);
+
+  // Choices are too many for the buffer: the parse falls back to two steps
+  string_t *choices = parser->command_choices;
+  parser->command_choices = strCreate(16);
+  panicif(!parser->command_choices, "cannot allocate choices");
+
+  case("in steps");
+  test("let the shears fall", ACTION_TYPE_DROP, NULL, &shears, NULL);
+  test("let the key fall", ACTION_TYPE_DROP, NULL, NULL, NULL);
+
+  case("concurrent");
+  parser->concurrent = 1;
+  test("let the shears fall", ACTION_TYPE_DROP, NULL, &shears, NULL);
+  test("let the key fall", ACTION_TYPE_DROP, NULL, NULL, NULL);
+  parser->concurrent = 0;
+
+  strDestroy(&parser->command_choices);
+  parser->command_choices = choices;
+#undef test
+}
+
+typedef struct {
+  const char *input;
+  action_type_t action;
+} labelled_t;
+
+// Inputs neither the classifier nor the model were trained on
+static labelled_t held_out[] = {
+    {"travel to hall", ACTION_TYPE_MOVE},
+    {"head north", ACTION_TYPE_MOVE},
+    {"stroll to the garden", ACTION_TYPE_MOVE},
+    {"descend into the crypt", ACTION_TYPE_MOVE},
+    {"retrieve the key", ACTION_TYPE_TAKE},
+    {"grab teh coin", ACTION_TYPE_TAKE},
+    {"snag the lantern", ACTION_TYPE_TAKE},
+    {"put the pelt on the altar", ACTION_TYPE_DROP},
+    {"release the coin", ACTION_TYPE_DROP},
+    {"abandon the sword", ACTION_TYPE_DROP},
+    {"throw away the apple", ACTION_TYPE_DROP},
+    {"apply paint", ACTION_TYPE_USE},
+    {"utilize the sword", ACTION_TYPE_USE},
+    {"opne the door", ACTION_TYPE_USE},
+    {"drink the water", ACTION_TYPE_USE},
+    {"study the key", ACTION_TYPE_EXAMINE},
+    {"check out the coin", ACTION_TYPE_EXAMINE},
+    {"peer at the mural", ACTION_TYPE_EXAMINE},
+    {"what does the note say", ACTION_TYPE_EXAMINE},
+    {"search the drawer", ACTION_TYPE_EXAMINE},
+};
+
+// Compares the classifier with the model: the classifier should be correct
+// whenever it is confident, and much faster.
+void benchmark(void) {
+  parser_t *parser cleanup(parserDestroy) = parserCreate();
+  panicif(!parser, "cannot initialize parser");
+
+  string_t *cmd cleanup(strDestroy) = strCreate(128);
+  panicif(!cmd, "cannot initialize command buffer");
+
+  const size_t count = arrLen(held_out);
+  uint64_t classifier_samples[arrLen(held_out)] = {};
+  uint64_t model_samples[arrLen(held_out)] = {};
+  size_t confident = 0, classifier_correct = 0, model_correct = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    float confidence = 0;
+    uint64_t elapsed = readTimer();
+    action_type_t action =
+        intentClassify(parser->intent, held_out[i].input, &confidence);
+    classifier_samples[i] = readTimer() - elapsed;
+    if (confidence >= INTENT_CONFIDENCE) {
+      confident++;
+      classifier_correct += action == held_out[i].action;
+    }
+  }
+
+  parser->model_only = 1;
+  operation_t op;
+  for (size_t i = 0; i < count; i++) {
+    strFmt(cmd, "%s", held_out[i].input);
+    uint64_t elapsed = readTimer();
+    parserGetOperation(parser, &op, cmd);
+    model_samples[i] = readTimer() - elapsed;
+    model_correct += op.as.action == held_out[i].action;
+  }
+
+  const double classifier_time = avgllu(count, classifier_samples);
+  const double model_time = avgllu(count, model_samples);
+  info("classifier: %zu/%zu confident, %zu correct", confident, count,
+       classifier_correct);
+  info("     model: %zu/%zu correct", model_correct, count);
+  info("classifier is %.0fx faster than the model",
+       model_time / classifier_time);
+
+  case("classifier");
+  expectTrue(confident >= count / 2, "is confident on most inputs");
+  expectEqllu(classifier_correct, confident, "is right when confident");
+}
+
+// Compares the shots most similar to the input with the fixed set of shots.
+// The KV cache is wiped before each input: it is shared by every prompt of
+// the parser, so the action prompt is often decoded from scratch.
+void shots(void) {
+  parser_t *parser cleanup(parserDestroy) = parserCreate();
+  panicif(!parser, "cannot initialize parser");
+
+  string_t *cmd cleanup(strDestroy) = strCreate(128);
+  panicif(!cmd, "cannot initialize command buffer");
+
+  const size_t count = arrLen(held_out);
+  const size_t modes[] = {0, PARSER_SHOTS};
+  uint64_t samples[arrLen(modes)][arrLen(held_out)] = {};
+  size_t tokens[arrLen(modes)] = {};
+  size_t correct[arrLen(modes)] = {};
+
+  parser->model_only = 1;
+  operation_t op;
+  for (size_t m = 0; m < arrLen(modes); m++) {
+    parser->shots = modes[m];
+    for (size_t i = 0; i < count; i++) {
+      strFmt(cmd, "%s", held_out[i].input);
+      aiClear(parser->ai);
+      uint64_t elapsed = readTimer();
+      parserGetOperation(parser, &op, cmd);
+      samples[m][i] = readTimer() - elapsed;
+      tokens[m] += parser->prompt->len;
+      correct[m] += op.as.action == held_out[i].action;
+    }
+  }
+
+  const double fixed_time = avgllu(count, samples[0]);
+  const double picked_time = avgllu(count, samples[1]);
+  info(" fixed shots: %zu tokens per prompt, %zu/%zu correct",
+       tokens[0] / count, correct[0], count);
+  info("picked shots: %zu tokens per prompt, %zu/%zu correct",
+       tokens[1] / count, correct[1], count);
+  info("picked shots are %.1fx faster than the fixed ones",
+       fixed_time / picked_time);
+
+  case("picked shots");
+  expectTrue(tokens[1] < tokens[0], "make shorter prompts");
+  expectTrue(correct[1] + 1 >= correct[0], "are about as accurate");
+}
+
 int main(void) {
   suite(actions);
   suite(commands);
   suite(targets);
+  suite(similar);
+  suite(parse);
+  suite(benchmark);
+  suite(shots);
   return report();
 }
@@ -1,7 +1,17 @@
 #pragma once
 
-#include <mach/mach_time.h>
 #include <stdint.h>
 
-// TODO: make this support at least linux for CI
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+
 uint64_t readTimer(void) { return mach_continuous_time(); }
+#else
+#include <time.h>
+
+uint64_t readTimer(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+#endif
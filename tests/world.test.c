@@ -167,8 +167,8 @@ void transition(void) {
   static char state[] = "state";
   static transitions_t transitions = bufConst(2, tr_1, tr_2);
   static descriptions_t descriptions = bufConst(3, state, state, state);
-  static item_t item_1 = {{it1_name, OBJECT_TYPE_ITEM,0 ,&descriptions, &transitions}, false, false};
-  static item_t item_2 = {{it2_name, OBJECT_TYPE_ITEM,0,&descriptions,NULL}, false, false};
+  static item_t item_1 = {{it1_name, OBJECT_TYPE_ITEM,0 ,&descriptions, &transitions, 0}, false, false};
+  static item_t item_2 = {{it2_name, OBJECT_TYPE_ITEM,0,&descriptions,NULL, 0}, false, false};
   static requirement_tuples_t items_reqs = bufConst(1, {it1_name, 0});
   static requirements_t reqs = {&items_reqs, NULL, NULL, NULL, 0};
   static requirement_tuple_t tuple_it2_0 = {it2_name, 0};
@@ -176,11 +176,11 @@ void transition(void) {
 
   static const transition_t tr_3 = { ACTION_TYPE_USE, 0, 1, &tuple_it2_0, &reqs };
   static transitions_t transitions_with_reqs = bufConst(1, tr_3);
-  static item_t item_3 = {{it3_name, OBJECT_TYPE_ITEM,0,&descriptions,&transitions_with_reqs}, false, false};
+  static item_t item_3 = {{it3_name, OBJECT_TYPE_ITEM,0,&descriptions,&transitions_with_reqs, 0}, false, false};
 
   static const transition_t tr_4 = { ACTION_TYPE_USE, 1, 2, &tuple_it2_1, &no_reqs };
   static transitions_t transitions_something_else = bufConst(1, tr_4);
-  static item_t item_4 = {{it4_name,OBJECT_TYPE_ITEM,0,&descriptions,&transitions_something_else},false,false};
+  static item_t item_4 = {{it4_name,OBJECT_TYPE_ITEM,0,&descriptions,&transitions_something_else, 0}, false, false};
 
   static items_t items = bufConst(4, &item_1, &item_2, &item_3, &item_4);
   static items_t inventory = bufConst(0);
@@ -199,10 +199,12 @@ void transition(void) {
   tr = worldExecuteTransition(&w, &item_1.object, ACTION_TYPE_USE, NULL, NULL);
   expectEqlu(tr, TRANSITION_RESULT_OK, "transitions");
   expectEqli(item_1.object.state, 1, "correct state");
+  expectEqlu(item_1.object.version, 1, "version bumped");
 
   tr = worldExecuteTransition(&w, &item_1.object, ACTION_TYPE_TAKE, NULL, NULL);
   expectEqlu(tr, TRANSITION_RESULT_NO_TRANSITION, "no transition on wrong action");
   expectEqli(item_1.object.state, 1, "state unchanged");
+  expectEqlu(item_1.object.version, 1, "version unchanged");
 
   tr = worldExecuteTransition(&w, &item_1.object, ACTION_TYPE_USE, NULL, NULL);
   expectEqlu(tr, TRANSITION_RESULT_OK, "transitions");
@@ -224,6 +226,43 @@ void transition(void) {
   tr = worldExecuteTransition(&w, &item_4.object, ACTION_TYPE_USE, NULL, NULL);
   expectEqlu(tr, TRANSITION_RESULT_OK, "transitions something else");
   expectEqli(item_2.object.state, 2, "state changed");
+
+  case("on a target");
+  item_2.object.state = 1;
+  tr = worldExecuteTransitionOn(&w, &item_4.object, &item_1.object,
+                                ACTION_TYPE_USE, NULL, NULL);
+  expectEqlu(tr, TRANSITION_RESULT_NO_TRANSITION, "not on other targets");
+  expectEqli(item_2.object.state, 1, "state unchanged on other targets");
+
+  tr = worldExecuteTransitionOn(&w, &item_4.object, &item_2.object,
+                                ACTION_TYPE_USE, NULL, NULL);
+  expectEqlu(tr, TRANSITION_RESULT_OK, "transitions the target");
+  expectEqli(item_2.object.state, 2, "state changed on the target");
+}
+
+void move(void) {
+  static char key_name[] = "key";
+  static char room_name[] = "room";
+  static item_t key = {.object.name = key_name};
+  static locations_t no_exits = {0, 0};
+  items_t *items cleanup(itemsDestroy) = itemsCreate(1);
+  items_t *inventory cleanup(itemsDestroy) = itemsCreate(1);
+  location_t room = {.object.name = room_name, .items = items, .exits = &no_exits};
+  bufPush(items, &key);
+
+  world_t w = {.inventory = inventory, .location = &room};
+
+  case("take");
+  worldTakeItem(&w, &key);
+  expectEqllu(inventory->len, 1, "item in inventory");
+  expectEqllu(items->len, 0, "item not in the location");
+  expectEqlu(room.object.version, 1, "location version bumped");
+
+  case("drop");
+  worldDropItem(&w, &key);
+  expectEqllu(inventory->len, 0, "item not in inventory");
+  expectEqllu(items->len, 1, "item in the location");
+  expectEqlu(room.object.version, 2, "location version bumped");
 }
 
 void requirements(void) {
@@ -231,7 +270,7 @@ void requirements(void) {
   requirements_result_t rr;
   static char description[] = "d";
   static descriptions_t descriptions = bufConst(1, description);
-  static item_t item_1 = {{tool_name, OBJECT_TYPE_ITEM,0,&descriptions,NULL}, false, false};
+  static item_t item_1 = {{tool_name, OBJECT_TYPE_ITEM,0,&descriptions,NULL, 0}, false, false};
   static items_t items = bufConst(1, &item_1);
   static items_t no_items = bufConst(0);
   world_t w = {
@@ -294,7 +333,7 @@ void requirements(void) {
   static char loc_desc_str[] = "loc";
   static descriptions_t loc_desc = bufConst(1, loc_desc_str);
   static char loc_1_name[] = "place";
-  static location_t loc_1 = {{loc_1_name, OBJECT_TYPE_LOCATION, 0, &loc_desc, NULL}, NULL, NULL};
+  static location_t loc_1 = {{loc_1_name, OBJECT_TYPE_LOCATION, 0, &loc_desc, NULL, 0}, NULL, NULL};
   static locations_t locations = bufConst(1, &loc_1);
   w.locations = &locations;
 
@@ -349,7 +388,7 @@ void requirements(void) {
   w.location->object.state = 0;
 
   static char other_place_desc_str[] = "other_place";
-  static location_t loc_2 = {{other_place_desc_str, OBJECT_TYPE_LOCATION, 0, &loc_desc, NULL}, NULL, NULL};
+  static location_t loc_2 = {{other_place_desc_str, OBJECT_TYPE_LOCATION, 0, &loc_desc, NULL, 0}, NULL, NULL};
   w.location = &loc_2;
   rr = worldAreRequirementsMet(&w, &reqs_current_loc);
   expectEqlu(rr, REQUIREMENTS_RESULT_CURRENT_LOCATION_MISMATCH, "current_location: mismatch");
@@ -395,6 +434,7 @@ int main(void) {
   suite(location);
   suite(digest);
   suite(transition);
+  suite(move);
   suite(requirements);
   return report();
 }
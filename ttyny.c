@@ -16,6 +16,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Descriptions narrated in previous sessions, for any story
+static const char ARCHIVE_PATH[] = "./descriptions.archive";
 
 typedef strings_t states_t;
 states_t *statesCreate(size_t cap) {
@@ -49,6 +53,38 @@ void statesDestroy(states_t **self) {
   deallocate(self);
 }
 
+// Shows descriptions on screen while the master is writing them
+typedef struct {
+  ui_stream_t *stream;
+  ui_handle_t **loading;
+  const world_t *world;
+  string_t *chunk;
+} description_stream_t;
+
+void descriptionStreamWrite(const char *text, size_t len, void *data) {
+  description_stream_t *self = data;
+  if (!self->stream) {
+    uiLoadingStop(self->loading);
+    self->stream = uiStreamStart();
+  }
+
+  strFmt(self->chunk, "%.*s", (int)len, text);
+  fmtCapitalizeWorldObjects(self->chunk, self->world);
+  uiStreamWrite(self->stream, self->chunk);
+}
+
+// Returns false when there was nothing streamed and the output still needs to
+// be printed
+int descriptionStreamStop(description_stream_t *self) {
+  if (!self->stream)
+    return 0;
+
+  uiStreamStop(&self->stream);
+  return 1;
+}
+
+void onTyping(const char *text, void *data) { parserTyping(data, text); }
+
 int quit(string_t *response, ui_handle_t *loading, const world_t *world) {
   uiLoadingStop(&loading);
   uiFormatAndPrintEndGame(response, GAME_STATE_DEAD, world);
@@ -79,16 +115,22 @@ int main(int argc, char **argv) {
   states_t *states cleanup(statesDestroy) = statesCreate(3);
 
   string_t *target cleanup(strDestroy) = strCreate(128);
+  string_t *chunk cleanup(strDestroy) = strCreate(4096);
 
   master_t *master cleanup(masterDestroy) = masterCreate(world);
   panicif(!master, "cannot create master");
+  masterOpenArchive(master, world, ARCHIVE_PATH);
+  // Authored descriptions are shown until the narrated ones are ready
+  masterSetProgressive(master, world);
 
   parser_t *parser cleanup(parserDestroy) = parserCreate();
   panicif(!parser, "cannot create parser");
-
-  locations_t *locations cleanup(locationsDestroy) =
-      locationsCreate(world->locations->cap);
-  items_t *items cleanup(itemsDestroy) = itemsCreate(world->items->cap);
+  parserPrepare(parser, world);
+  // Commands are parsed in a single generation whenever the choices fit: it
+  // is the only parse telling what items are used on. Otherwise, action and
+  // target are parsed side by side if there is a core for each.
+  parser->concurrent = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  parserTypingStart(parser);
 
   uiClearScreen();
 #ifdef NDEBUG
@@ -103,10 +145,16 @@ int main(int argc, char **argv) {
 #endif
   ui_handle_t *loading = uiLoadingStart();
 
+  description_stream_t description = {
+      .loading = &loading, .world = world, .chunk = chunk};
+  masterSetStream(master, descriptionStreamWrite, &description);
+
   masterDescribeLocation(master, world->location, response);
   uiLoadingStop(&loading);
-  fmtCapitalizeWorldObjects(response, world);
-  uiPrintDescription(response);
+  if (!descriptionStreamStop(&description)) {
+    fmtCapitalizeWorldObjects(response, world);
+    uiPrintDescription(response);
+  }
 
   string_t *state = statesNext(states);
   fmtLocationChange(state, world->location);
@@ -117,7 +165,9 @@ int main(int argc, char **argv) {
   cli_readline_result_t readline_result;
 
   while (1) {
-    readline_result = cliReadline(input);
+    // Describes where the player might go next, while they read and type
+    masterPrefetch(master, world);
+    readline_result = cliReadline(input, onTyping, parser);
 
     switch (readline_result) {
     case CLI_READLINE_RESULT_EMPTY:
@@ -132,8 +182,16 @@ int main(int argc, char **argv) {
     strClear(response);
     loading = uiLoadingStart();
 
+    // Perform some cheap validation before invoking the AI
+    if (bufAt(input, 0) != '/' && !strchr(input->data, ' ')) {
+      strFmt(response, "I need more details...");
+      uiLoadingStop(&loading);
+      uiPrintError(response);
+      continue;
+    }
+
     operation_t operation;
-    parserGetOperation(parser, &operation, input);
+    parserParse(parser, world, input, &operation);
 
     if (operation.type == OPERATION_TYPE_COMMAND) {
       switch (operation.as.command) {
@@ -170,24 +228,14 @@ int main(int argc, char **argv) {
       continue;
     }
 
-    // Perform some cheap validation before invoking further AI
-    if (!strchr(input->data, ' ')) {
-      strFmt(response, "I need more details...");
-      uiLoadingStop(&loading);
-      uiPrintError(response);
-      continue;
-    }
-
     action_type_t action = operation.as.action;
 
     // Advance turn count only for actions, not for commands
     world->turns++;
 
-    item_t *item = NULL;
-    location_t *location = NULL;
+    item_t *item = operation.item;
+    location_t *location = operation.location;
 
-    bufClear(items, NULL);
-    bufClear(locations, NULL);
     statesReset(states);
 
     transition_result_t trans_result;
@@ -195,9 +243,6 @@ int main(int argc, char **argv) {
 
     switch (action) {
     case ACTION_TYPE_MOVE: {
-      parserExtractTarget(parser, input, world->location->exits, items,
-                          &location, &item);
-
       if (!location) {
         strFmt(response, "You cannot go there!");
         printCallback = uiPrintError;
@@ -225,11 +270,6 @@ int main(int argc, char **argv) {
       break;
     }
     case ACTION_TYPE_EXAMINE: {
-      bufCat(items, world->location->items);
-      bufCat(items, world->inventory);
-      parserExtractTarget(parser, input, world->location->exits, items,
-                          &location, &item);
-
       if (item) {
         // This is non-functional transition. No need to check result
         trans_result =
@@ -256,9 +296,6 @@ int main(int argc, char **argv) {
       break;
     }
     case ACTION_TYPE_TAKE: {
-      parserExtractTarget(parser, input, locations, world->location->items,
-                          &location, &item);
-
       if (!item) {
         strFmt(response, "Take what? You need to be more specific than that.");
         printCallback = uiPrintError;
@@ -282,15 +319,10 @@ int main(int argc, char **argv) {
         break;
       }
 
-      bufPush(world->inventory, item);
-      bufRemove(world->location->items, item, NULL);
+      worldTakeItem(world, item);
 
       masterDescribeAction(master, world, input, &item->object, affected,
                            affected_initial_state, response);
-      // When taking an object, the room description must be regenerated
-      // else it'll mention objects you have in the inventory
-      masterForget(master, &world->location->object, LOCATION_NAMESPACE);
-      masterForget(master, &world->location->object, OBJECT_NAMESPACE);
 
       printCallback = uiPrintDescription;
       state = statesNext(states);
@@ -303,9 +335,6 @@ int main(int argc, char **argv) {
       break;
     }
     case ACTION_TYPE_DROP: {
-      parserExtractTarget(parser, input, locations, world->inventory, &location,
-                          &item);
-
       if (!item) {
         strFmt(response, "You cannot drop something that you don't own.");
         printCallback = uiPrintError;
@@ -323,15 +352,10 @@ int main(int argc, char **argv) {
         break;
       }
 
-      bufPush(world->location->items, item);
-      bufRemove(world->inventory, item, NULL);
+      worldDropItem(world, item);
 
       masterDescribeAction(master, world, input, &item->object, affected,
                            affected_initial_state, response);
-      // When dropping an object, the room description must be regenerated
-      // else it won't mention the object just dropped
-      masterForget(master, &world->location->object, LOCATION_NAMESPACE);
-      masterForget(master, &world->location->object, OBJECT_NAMESPACE);
 
       printCallback = uiPrintDescription;
       state = statesNext(states);
@@ -345,27 +369,25 @@ int main(int argc, char **argv) {
       break;
     }
     case ACTION_TYPE_USE: {
-      bufCat(items, world->inventory);
-      bufCat(items, world->location->items);
-      parserExtractTarget(parser, input, locations, items, &location, &item);
-
       if (!item) {
         strFmt(response, "Not sure what you mean.");
         printCallback = uiPrintError;
         break;
       }
 
+      // Items used on something only affect that
+      const object_t *indirect =
+          operation.indirect ? &operation.indirect->object : NULL;
       object_t *affected = NULL;
       object_state_t affected_initial_state = OBJECT_STATE_ANY;
-      trans_result = worldExecuteTransition(world, &item->object, action,
-                                            &affected, &affected_initial_state);
+      trans_result =
+          worldExecuteTransitionOn(world, &item->object, indirect, action,
+                                   &affected, &affected_initial_state);
 
       switch (trans_result) {
       case TRANSITION_RESULT_OK:
         masterDescribeAction(master, world, input, &item->object, affected,
                              affected_initial_state, response);
-        masterForget(master, &item->object, OBJECT_NAMESPACE);
-        masterForget(master, &item->object, ITEM_NAMESPACE);
 
         printCallback = uiPrintDescription;
         state = statesNext(states);
@@ -387,8 +409,14 @@ int main(int argc, char **argv) {
         break;
       case TRANSITION_RESULT_NO_TRANSITION:
       default:
-        strFmt(response, "Did you mean %s? Unfortunately, it cannot be used...",
-               item->object.name);
+        if (indirect) {
+          strFmt(response, "You cannot use %s on %s.", item->object.name,
+                 indirect->name);
+        } else {
+          strFmt(response,
+                 "Did you mean %s? Unfortunately, it cannot be used...",
+                 item->object.name);
+        }
         printCallback = uiPrintError;
         break;
       }
@@ -403,16 +431,25 @@ int main(int argc, char **argv) {
 
     worldDigest(world, &game_state);
     if (game_state != GAME_STATE_CONTINUE) {
+      // The action has been narrated already: wait for the ending
+      if (descriptionStreamStop(&description)) {
+        loading = uiLoadingStart();
+      }
+
       masterDescribeEndGame(master, input, world, game_state, response);
       uiLoadingStop(&loading);
-      uiPrintDescription(response);
+      if (!descriptionStreamStop(&description)) {
+        uiPrintDescription(response);
+      }
       uiFormatAndPrintEndGame(response, game_state, world);
       return 0;
     }
 
     uiLoadingStop(&loading);
-    fmtCapitalizeWorldObjects(response, world);
-    printCallback(response);
+    if (!descriptionStreamStop(&description)) {
+      fmtCapitalizeWorldObjects(response, world);
+      printCallback(response);
+    }
     uiPrintStateUpdates(states);
   }
 